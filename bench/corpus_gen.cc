@@ -0,0 +1,299 @@
+/// told_corpus_gen - writes a synthetic corpus of x86-64 relocatable objects.
+///
+///   ./told_corpus_gen --dir=DIR [--objects=N] [--functions=N] [--calls=N]
+///                     [--cross-module=PERCENT] [--pad=BYTES] [--seed=N]
+///                     [--iterations=N] [--budget=N]
+///
+/// Writes DIR/obj_0.o .. DIR/obj_<N-1>.o. Every object defines --functions
+/// global functions, each making --calls calls (one R_X86_64_PLT32 each), of
+/// which --cross-module percent go to functions in other objects. obj_0.o also
+/// defines _start, so the corpus links into a program that actually runs:
+///
+///   f:  dec %edi ; js 1f ; call ... ; call ... ; 1: ret ; int3 padding
+///
+/// %edi is a global call budget shared by every function, so _start running
+/// `--iterations` walks of `--budget` calls each terminates no matter how the
+/// call graph is shaped, and then exits with status 0.
+///
+/// The same options and seed always give byte-identical objects.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "elf_utils.h"
+
+namespace fs = std::filesystem;
+
+// ELF64_R_INFO refers to it unqualified.
+using elf::Elf64_Xword;
+
+struct CorpusOptions {
+  fs::path dir{};
+  size_t objects = 100;
+  size_t functions = 50;
+  size_t calls = 4;
+  size_t cross_module_percent = 50;
+  size_t pad = 0;
+  uint64_t seed = 1;
+  uint32_t iterations = 1;
+  uint32_t budget = 100000;
+};
+
+std::string function_name(size_t obj, size_t fn) {
+  return "f_" + std::to_string(obj) + "_" + std::to_string(fn);
+}
+
+struct StringTableBuilder {
+  std::vector<char> data{'\0'};
+
+  elf::Elf64_Word add(std::string_view s) {
+    auto offset = static_cast<elf::Elf64_Word>(data.size());
+    data.insert(data.end(), s.begin(), s.end());
+    data.push_back('\0');
+    return offset;
+  }
+};
+
+template <typename T> void append(std::vector<char> &out, const T &value) {
+  const char *p = reinterpret_cast<const char *>(&value);
+  out.insert(out.end(), p, p + sizeof(T));
+}
+
+void align_to(std::vector<char> &out, size_t alignment) {
+  while (out.size() % alignment != 0)
+    out.push_back('\0');
+}
+
+std::vector<char> build_object(const CorpusOptions &o, size_t obj,
+                               std::mt19937_64 &rng) {
+  std::vector<char> text{};
+  std::vector<elf::ElfRelocAddendEntry> relas{};
+  StringTableBuilder strtab{};
+  std::vector<elf::ElfSymbolTableEntry> locals{};
+  std::vector<elf::ElfSymbolTableEntry> globals{};
+  // undefined functions we call, in order of first use.
+  std::vector<std::string> undef_names{};
+  std::unordered_map<std::string, size_t> undef_slots{};
+
+  // null symbol and the .text section symbol.
+  locals.push_back(elf::ElfSymbolTableEntry{});
+  locals.push_back(elf::ElfSymbolTableEntry{
+      0, ELF64_ST_INFO(STB_LOCAL, STT_SECTION), 0, 1, 0, 0});
+
+  // globals are numbered after the locals: first our definitions, then the
+  // undefined references, which are only known once the code is generated.
+  auto defined_index = [&](size_t fn) {
+    return static_cast<elf::Elf64_Xword>(locals.size() + fn);
+  };
+  size_t defined_count = o.functions + (obj == 0 ? 1 : 0);
+  auto undef_index = [&](const std::string &name) {
+    auto [it, inserted] = undef_slots.try_emplace(name, undef_names.size());
+    if (inserted)
+      undef_names.push_back(name);
+    return static_cast<elf::Elf64_Xword>(locals.size() + defined_count +
+                                         it->second);
+  };
+  auto emit_call = [&](elf::Elf64_Xword sym) {
+    text.push_back('\xe8');
+    relas.push_back(elf::ElfRelocAddendEntry{
+        text.size(), ELF64_R_INFO(sym, R_X86_64_PLT32), -4});
+    append<int32_t>(text, 0);
+  };
+
+  std::uniform_int_distribution<size_t> pick_fn(0, o.functions - 1);
+  std::uniform_int_distribution<size_t> pick_obj(0, o.objects - 1);
+  std::uniform_int_distribution<size_t> pick_percent(0, 99);
+  for (size_t fn = 0; fn < o.functions; ++fn) {
+    align_to(text, 16);
+    size_t start = text.size();
+    text.insert(text.end(), {'\xff', '\xcf'}); // dec %edi
+    text.insert(text.end(), {'\x0f', '\x88'}); // js rel32 -> ret
+    append<int32_t>(text, static_cast<int32_t>(o.calls * 5));
+    for (size_t c = 0; c < o.calls; ++c) {
+      size_t target_obj = obj;
+      if (o.objects > 1 && pick_percent(rng) < o.cross_module_percent) {
+        while (target_obj == obj)
+          target_obj = pick_obj(rng);
+      }
+      size_t target_fn = pick_fn(rng);
+      if (target_obj == obj)
+        emit_call(defined_index(target_fn));
+      else
+        emit_call(undef_index(function_name(target_obj, target_fn)));
+    }
+    text.push_back('\xc3'); // ret
+    text.insert(text.end(), o.pad, '\xcc');
+    globals.push_back(elf::ElfSymbolTableEntry{
+        strtab.add(function_name(obj, fn)),
+        ELF64_ST_INFO(STB_GLOBAL, STT_FUNC), 0, 1, start, text.size() - start});
+  }
+
+  if (obj == 0) {
+    align_to(text, 16);
+    size_t start = text.size();
+    text.push_back('\xbb'); // mov $iterations, %ebx
+    append<uint32_t>(text, o.iterations);
+    size_t loop = text.size();
+    text.push_back('\xbf'); // mov $budget, %edi
+    append<uint32_t>(text, o.budget);
+    emit_call(defined_index(0));
+    text.insert(text.end(), {'\xff', '\xcb'}); // dec %ebx
+    text.push_back('\x75');                    // jnz loop
+    text.push_back(static_cast<char>(loop - (text.size() + 1)));
+    text.push_back('\xb8'); // mov $60, %eax
+    append<uint32_t>(text, 60);
+    text.insert(text.end(), {'\x31', '\xff', '\x0f', '\x05'}); // exit(0)
+    globals.push_back(elf::ElfSymbolTableEntry{
+        strtab.add("_start"), ELF64_ST_INFO(STB_GLOBAL, STT_FUNC), 0, 1, start,
+        text.size() - start});
+  }
+  for (const auto &name : undef_names) {
+    globals.push_back(elf::ElfSymbolTableEntry{
+        strtab.add(name), ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE), 0, SHN_UNDEF,
+        0, 0});
+  }
+
+  StringTableBuilder shstrtab{};
+  elf::Elf64_Word text_name = shstrtab.add(".text");
+  elf::Elf64_Word rela_name = shstrtab.add(".rela.text");
+  elf::Elf64_Word symtab_name = shstrtab.add(".symtab");
+  elf::Elf64_Word strtab_name = shstrtab.add(".strtab");
+  elf::Elf64_Word shstrtab_name = shstrtab.add(".shstrtab");
+
+  // layout: header, .text, .rela.text, .symtab, .strtab, .shstrtab, headers.
+  std::vector<char> out(sizeof(elf::ElfHeader));
+  std::vector<elf::ElfSectionHeader> shs(6);
+
+  align_to(out, 16);
+  shs[1] = {text_name, SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, 0, out.size(),
+            text.size(), 0, 0, 16, 0};
+  out.insert(out.end(), text.begin(), text.end());
+
+  align_to(out, 8);
+  shs[2] = {rela_name,
+            SHT_RELA,
+            SHF_INFO_LINK,
+            0,
+            out.size(),
+            relas.size() * sizeof(elf::ElfRelocAddendEntry),
+            3,
+            1,
+            8,
+            sizeof(elf::ElfRelocAddendEntry)};
+  for (const auto &r : relas)
+    append(out, r);
+
+  shs[3] = {symtab_name,
+            SHT_SYMTAB,
+            0,
+            0,
+            out.size(),
+            (locals.size() + globals.size()) * sizeof(elf::ElfSymbolTableEntry),
+            4,
+            static_cast<elf::Elf64_Word>(locals.size()),
+            8,
+            sizeof(elf::ElfSymbolTableEntry)};
+  for (const auto &s : locals)
+    append(out, s);
+  for (const auto &s : globals)
+    append(out, s);
+
+  shs[4] = {strtab_name, SHT_STRTAB,       0, 0, out.size(),
+            strtab.data.size(), 0, 0, 1, 0};
+  out.insert(out.end(), strtab.data.begin(), strtab.data.end());
+
+  shs[5] = {shstrtab_name, SHT_STRTAB, 0, 0, out.size(), shstrtab.data.size(),
+            0, 0, 1, 0};
+  out.insert(out.end(), shstrtab.data.begin(), shstrtab.data.end());
+
+  align_to(out, 8);
+  elf::ElfHeader eh{};
+  eh.e_ident[0] = '\x7f';
+  eh.e_ident[1] = 'E';
+  eh.e_ident[2] = 'L';
+  eh.e_ident[3] = 'F';
+  eh.e_ident[EI_CLASS] = ELFCLASS64;
+  eh.e_ident[EI_DATA] = ELFDATA2LSB;
+  eh.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+  eh.e_ident[EI_VERSION] = EV_CURRENT;
+  eh.e_type = ET_REL;
+  eh.e_machine = EM_X86_64;
+  eh.e_version = EV_CURRENT;
+  eh.e_shoff = out.size();
+  eh.e_ehsize = sizeof(elf::ElfHeader);
+  eh.e_shentsize = sizeof(elf::ElfSectionHeader);
+  eh.e_shnum = static_cast<elf::Elf64_Half>(shs.size());
+  eh.e_shstrndx = 5;
+  for (const auto &sh : shs)
+    append(out, sh);
+  std::memcpy(out.data(), &eh, sizeof(eh));
+  return out;
+}
+
+bool parse_option(std::string_view arg, std::string_view flag, size_t &out) {
+  if (!arg.starts_with(flag))
+    return false;
+  out = std::stoull(std::string{arg.substr(flag.size())});
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  CorpusOptions o{};
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg{argv[i]};
+    size_t v{};
+    if (arg.starts_with("--dir=")) {
+      o.dir = std::string{arg.substr(6)};
+    } else if (parse_option(arg, "--objects=", o.objects) ||
+               parse_option(arg, "--functions=", o.functions) ||
+               parse_option(arg, "--calls=", o.calls) ||
+               parse_option(arg, "--cross-module=", o.cross_module_percent) ||
+               parse_option(arg, "--pad=", o.pad)) {
+    } else if (parse_option(arg, "--seed=", v)) {
+      o.seed = v;
+    } else if (parse_option(arg, "--iterations=", v)) {
+      o.iterations = static_cast<uint32_t>(v);
+    } else if (parse_option(arg, "--budget=", v)) {
+      o.budget = static_cast<uint32_t>(v);
+    } else {
+      std::cerr << "told_corpus_gen: unknown option " << arg << "\n";
+      return 1;
+    }
+  }
+  if (o.dir.empty() || o.objects == 0 || o.functions == 0 ||
+      o.iterations == 0) {
+    std::cerr << "usage: told_corpus_gen --dir=DIR [--objects=N] "
+                 "[--functions=N] [--calls=N] [--cross-module=PERCENT] "
+                 "[--pad=BYTES] [--seed=N] [--iterations=N] [--budget=N]\n";
+    return 1;
+  }
+
+  fs::create_directories(o.dir);
+  std::mt19937_64 rng{o.seed};
+  size_t bytes{};
+  for (size_t obj = 0; obj < o.objects; ++obj) {
+    std::vector<char> contents = build_object(o, obj, rng);
+    fs::path path = o.dir / ("obj_" + std::to_string(obj) + ".o");
+    std::ofstream f{path, std::ios::binary | std::ios::trunc};
+    f.write(contents.data(), static_cast<std::streamsize>(contents.size()));
+    if (!f) {
+      std::cerr << "told_corpus_gen: could not write " << path << "\n";
+      return 1;
+    }
+    bytes += contents.size();
+  }
+  std::printf("wrote %zu objects (%zu functions, %zu relocations, %zu bytes) "
+              "to %s\n",
+              o.objects, o.objects * o.functions,
+              o.objects * o.functions * o.calls + 1, bytes,
+              o.dir.string().c_str());
+}
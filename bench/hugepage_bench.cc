@@ -0,0 +1,203 @@
+/// told_hugepage_bench - page faults and iTLB misses, 4KB vs 2MB text layout.
+///
+///   ./told_hugepage_bench [--runs=N] [LINK OPTION].. INPUT..
+///
+/// Links the INPUTs (object files or directories of them, as for told_bench)
+/// twice, once with the default layout and once with --hugepage-text, then
+/// runs each program --runs times and reports the median page faults, iTLB
+/// misses and wall time of a run. Use a corpus with a lot of text that the
+/// program actually walks, e.g.
+///
+///   ./told_corpus_gen --dir=/tmp/big --objects=2000 --functions=50 --pad=256
+///                     --iterations=20
+///   ./told_hugepage_bench /tmp/big
+///
+/// Whether the kernel actually backs the 2MB aligned text with huge pages
+/// depends on its THP settings (file backed text needs
+/// CONFIG_READ_ONLY_THP_FOR_FS and khugepaged); the layout is what makes it
+/// possible at all. iTLB misses are read with perf_event_open and show up as
+/// n/a where that isn't allowed.
+
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "told.h"
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+struct RunCounts {
+  double wall_ms;
+  long minor_faults;
+  long major_faults;
+  std::optional<uint64_t> itlb_misses;
+};
+
+std::vector<std::string> expand_inputs(const std::vector<std::string> &args) {
+  std::vector<std::string> paths{};
+  for (const auto &arg : args) {
+    if (!fs::is_directory(arg)) {
+      paths.push_back(arg);
+      continue;
+    }
+    std::vector<std::string> objects{};
+    for (const auto &entry : fs::directory_iterator(arg))
+      if (entry.path().extension() == ".o")
+        objects.push_back(entry.path().string());
+    std::sort(objects.begin(), objects.end(),
+              [](const std::string &a, const std::string &b) {
+                return a.size() != b.size() ? a.size() < b.size() : a < b;
+              });
+    paths.insert(paths.end(), objects.begin(), objects.end());
+  }
+  return paths;
+}
+
+// Counts user space iTLB read misses of `pid` from its next exec on, or
+// returns -1 if the kernel won't let us.
+int open_itlb_counter(pid_t pid) {
+  perf_event_attr attr{};
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_ITLB |
+                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.enable_on_exec = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return static_cast<int>(
+      syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0));
+}
+
+// Runs `program` once. The child waits on a pipe until its counter is set up,
+// so that everything from the exec on is counted.
+RunCounts run_once(const std::string &program) {
+  int go[2];
+  if (pipe(go) != 0)
+    throw std::runtime_error("pipe failed");
+  auto start = Clock::now();
+  pid_t pid = fork();
+  if (pid < 0)
+    throw std::runtime_error("fork failed");
+  if (pid == 0) {
+    close(go[1]);
+    char c;
+    if (read(go[0], &c, 1) != 1)
+      _exit(127);
+    close(go[0]);
+    execl(program.c_str(), program.c_str(), nullptr);
+    _exit(127);
+  }
+  close(go[0]);
+  int counter = open_itlb_counter(pid);
+  if (write(go[1], "x", 1) != 1)
+    throw std::runtime_error("could not start " + program);
+  close(go[1]);
+
+  int status{};
+  rusage usage{};
+  wait4(pid, &status, 0, &usage);
+  auto end = Clock::now();
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    throw std::runtime_error(program + " did not exit with status 0");
+
+  RunCounts counts{std::chrono::duration<double, std::milli>(end - start)
+                       .count(),
+                   usage.ru_minflt, usage.ru_majflt, std::nullopt};
+  if (counter >= 0) {
+    uint64_t misses{};
+    if (read(counter, &misses, sizeof(misses)) == sizeof(misses))
+      counts.itlb_misses = misses;
+    close(counter);
+  }
+  return counts;
+}
+
+template <typename T> T median(std::vector<T> values) {
+  std::sort(values.begin(), values.end());
+  return values[values.size() / 2];
+}
+
+int main(int argc, char *argv[]) {
+  size_t runs = 10;
+  told::LinkOptions options{};
+  std::vector<std::string> args{};
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg{argv[i]};
+    if (arg.starts_with("--runs="))
+      runs = std::stoul(std::string{arg.substr(7)});
+    else if (!told::parse_link_option(arg, options))
+      args.emplace_back(arg);
+  }
+  std::vector<std::string> paths = expand_inputs(args);
+  if (paths.empty() || runs == 0) {
+    std::cerr << "usage: told_hugepage_bench [--runs=N] [LINK OPTION].. "
+                 "INPUT..\n";
+    return 1;
+  }
+
+  struct Layout {
+    const char *name;
+    bool hugepage_text;
+  };
+  const Layout layouts[] = {{"4KB", false}, {"2MB (--hugepage-text)", true}};
+  std::printf("%zu inputs, median of %zu runs\n", paths.size(), runs);
+  std::printf("%-24s %12s %12s %12s %14s %10s\n", "layout", "text (B)",
+              "minor flt", "major flt", "iTLB misses", "wall (ms)");
+  for (const auto &layout : layouts) {
+    told::LinkOptions link_options = options;
+    link_options.hugepage_text = layout.hugepage_text;
+    const std::string program =
+        (fs::temp_directory_path() /
+         (layout.hugepage_text ? "told_hugepage_2m" : "told_hugepage_4k"))
+            .string();
+    std::vector<RunCounts> counts{};
+    size_t text_size{};
+    try {
+      told::Executable e = told::link(told::parse_objects(paths), {}, program,
+                                      link_options);
+      told::write_out(e);
+      fs::permissions(program, fs::perms::owner_all);
+      text_size = e.segment(elf::SectionType::Text).size;
+      for (size_t r = 0; r < runs; ++r)
+        counts.push_back(run_once(program));
+    } catch (const std::exception &err) {
+      std::cerr << "told_hugepage_bench: " << err.what() << "\n";
+      return 1;
+    }
+    fs::remove(program);
+
+    std::vector<long> minor{}, major{};
+    std::vector<uint64_t> itlb{};
+    std::vector<double> wall{};
+    for (const auto &c : counts) {
+      minor.push_back(c.minor_faults);
+      major.push_back(c.major_faults);
+      wall.push_back(c.wall_ms);
+      if (c.itlb_misses.has_value())
+        itlb.push_back(*c.itlb_misses);
+    }
+    std::string itlb_str =
+        itlb.empty() ? "n/a" : std::to_string(median(itlb));
+    std::printf("%-24s %12zu %12ld %12ld %14s %10.3f\n", layout.name,
+                text_size, median(minor), median(major), itlb_str.c_str(),
+                median(wall));
+  }
+}
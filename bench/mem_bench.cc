@@ -0,0 +1,154 @@
+/// told_mem_bench - how much heap does a link hold per input symbol?
+///
+///   ./told_mem_bench [--threads=N] [LINK OPTION].. INPUT..
+///
+/// INPUTs are object files or directories of them, as for told_bench. The
+/// link is run up to (but not including) writing the output, and the live
+/// heap is sampled after each phase. Mapped input files aren't heap and
+/// aren't counted, only the structures told builds on top of them are.
+
+#include <malloc.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <new>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "parallel.h"
+#include "told.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+std::atomic<size_t> live_bytes{0};
+std::atomic<size_t> peak_bytes{0};
+
+void *counted_alloc(size_t n) {
+  void *p = std::malloc(n == 0 ? 1 : n);
+  if (p == nullptr)
+    throw std::bad_alloc{};
+  size_t live = live_bytes.fetch_add(malloc_usable_size(p)) +
+                malloc_usable_size(p);
+  size_t peak = peak_bytes.load(std::memory_order_relaxed);
+  while (live > peak && !peak_bytes.compare_exchange_weak(peak, live))
+    ;
+  return p;
+}
+
+void counted_free(void *p) {
+  if (p == nullptr)
+    return;
+  live_bytes.fetch_sub(malloc_usable_size(p));
+  std::free(p);
+}
+
+} // namespace
+
+void *operator new(size_t n) { return counted_alloc(n); }
+void *operator new[](size_t n) { return counted_alloc(n); }
+void operator delete(void *p) noexcept { counted_free(p); }
+void operator delete[](void *p) noexcept { counted_free(p); }
+void operator delete(void *p, size_t) noexcept { counted_free(p); }
+void operator delete[](void *p, size_t) noexcept { counted_free(p); }
+
+std::vector<std::string> expand_inputs(const std::vector<std::string> &args) {
+  std::vector<std::string> paths{};
+  for (const auto &arg : args) {
+    if (!fs::is_directory(arg)) {
+      paths.push_back(arg);
+      continue;
+    }
+    std::vector<std::string> objects{};
+    for (const auto &entry : fs::directory_iterator(arg))
+      if (entry.path().extension() == ".o")
+        objects.push_back(entry.path().string());
+    std::sort(objects.begin(), objects.end(),
+              [](const std::string &a, const std::string &b) {
+                return a.size() != b.size() ? a.size() < b.size() : a < b;
+              });
+    paths.insert(paths.end(), objects.begin(), objects.end());
+  }
+  return paths;
+}
+
+int main(int argc, char *argv[]) {
+  told::LinkOptions options{};
+  std::vector<std::string> args{};
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg{argv[i]};
+    if (arg.starts_with("--threads="))
+      told::set_thread_count(std::stoul(std::string{arg.substr(10)}));
+    else if (!told::parse_link_option(arg, options))
+      args.emplace_back(arg);
+  }
+  std::vector<std::string> paths = expand_inputs(args);
+  if (paths.empty()) {
+    std::cerr << "usage: told_mem_bench [--threads=N] [LINK OPTION].. "
+                 "INPUT..\n";
+    return 1;
+  }
+
+  struct Sample {
+    std::string phase;
+    size_t live;
+  };
+  std::vector<Sample> samples{};
+  samples.reserve(8);
+  const size_t baseline = live_bytes.load();
+  auto sample = [&](const char *phase) {
+    samples.push_back(Sample{phase, live_bytes.load() - baseline});
+  };
+
+  size_t input_symbols{};
+  size_t global_symbols{};
+  try {
+    std::vector<elf::ElfBinary> parsed = told::parse_objects(paths);
+    for (const auto &mod : parsed)
+      input_symbols += mod.symtab_entries.size();
+    sample("parse");
+
+    told::Executable e = told::init_exec(
+        (fs::temp_directory_path() / "told_mem_bench.out").string(),
+        std::move(parsed), {}, options);
+    told::resolve_symbols(e);
+    global_symbols = e.g_symbol_table.size();
+    sample("resolve_symbols");
+
+    if (options.gc_sections)
+      told::gc_sections(e);
+    if (options.icf)
+      told::fold_identical_code(e);
+    told::compute_output_offsets(e);
+    told::merge_sections(e);
+    told::create_got(e);
+    told::apply_addrs_and_adjustments_to_segments(e);
+    told::apply_addrs_to_symbols(e);
+    told::apply_headers(e);
+    sample("layout");
+  } catch (const std::exception &err) {
+    std::cerr << "told_mem_bench: " << err.what() << "\n";
+    return 1;
+  }
+
+  std::printf("%zu inputs, %zu input symbols, %zu global symbols\n",
+              paths.size(), input_symbols, global_symbols);
+  std::printf("%-24s %14s %18s\n", "after", "live heap (B)",
+              "B / input symbol");
+  for (const auto &s : samples) {
+    std::printf("%-24s %14zu %18.1f\n", s.phase.c_str(), s.live,
+                static_cast<double>(s.live) /
+                    static_cast<double>(std::max<size_t>(input_symbols, 1)));
+  }
+  std::printf("%-24s %14zu %18.1f\n", "peak",
+              peak_bytes.load() - baseline,
+              static_cast<double>(peak_bytes.load() - baseline) /
+                  static_cast<double>(std::max<size_t>(input_symbols, 1)));
+}
@@ -0,0 +1,82 @@
+/// told_parse_bench - how does parse time scale with --threads?
+///
+/// Parses the given objects with told::parse_objects at 1, 2, 4, ... threads
+/// (up to --max-threads, default all cores) and prints the wall time of each.
+///
+///   ./told_parse_bench [--repeat=N] [--max-threads=N] FILE1 .. FILEN
+///
+/// Pass the same file several times to simulate a large link.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "parallel.h"
+#include "told.h"
+
+using Clock = std::chrono::steady_clock;
+
+double time_parse_ms(const std::vector<std::string> &paths) {
+  auto start = Clock::now();
+  std::vector<elf::ElfBinary> modules = told::parse_objects(paths);
+  auto end = Clock::now();
+  // keep the result alive until after the timer stops, unmapping is not part
+  // of what we want to measure.
+  if (modules.size() != paths.size())
+    std::abort();
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+int main(int argc, char *argv[]) {
+  size_t repeat = 5;
+  size_t max_threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+  std::vector<std::string> paths{};
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg{argv[i]};
+    if (arg.starts_with("--repeat=")) {
+      repeat = std::stoul(std::string{arg.substr(9)});
+    } else if (arg.starts_with("--max-threads=")) {
+      max_threads = std::stoul(std::string{arg.substr(14)});
+    } else {
+      paths.emplace_back(arg);
+    }
+  }
+  if (paths.empty() || repeat == 0 || max_threads == 0) {
+    std::cerr << "usage: told_parse_bench [--repeat=N] [--max-threads=N] "
+                 "FILE1 .. FILEN\n";
+    return 1;
+  }
+
+  std::vector<size_t> thread_counts{};
+  for (size_t t = 1; t < max_threads; t *= 2)
+    thread_counts.push_back(t);
+  thread_counts.push_back(max_threads);
+
+  std::printf("%zu inputs, best and median of %zu runs\n", paths.size(),
+              repeat);
+  std::printf("%8s %12s %12s %9s\n", "threads", "best (ms)", "median (ms)",
+              "speedup");
+  double serial_best{};
+  try {
+    for (size_t t : thread_counts) {
+      told::set_thread_count(t);
+      std::vector<double> runs{};
+      for (size_t r = 0; r < repeat; ++r)
+        runs.push_back(time_parse_ms(paths));
+      std::sort(runs.begin(), runs.end());
+      if (t == 1)
+        serial_best = runs.front();
+      std::printf("%8zu %12.3f %12.3f %8.2fx\n", t, runs.front(),
+                  runs[runs.size() / 2], serial_best / runs.front());
+    }
+  } catch (const std::exception &err) {
+    std::cerr << "told_parse_bench: " << err.what() << "\n";
+    return 1;
+  }
+}
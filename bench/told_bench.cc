@@ -0,0 +1,198 @@
+/// told_bench - times every phase of a told link.
+///
+///   ./told_bench [--repeat=N] [--threads=N] [--keep-output=FILE]
+///                [LINK OPTION].. INPUT..
+///
+/// Each INPUT is an object file or a directory whose *.o files are all linked
+/// (in name order), e.g. one written by told_corpus_gen:
+///
+///   ./told_corpus_gen --dir=/tmp/corpus --objects=2000 --functions=100
+///   ./told_bench /tmp/corpus
+///
+/// Link options (e.g. --gc-sections) are applied as they are by told. The link
+/// is repeated --repeat times and the best and median time of each phase is
+/// reported, so the numbers can be compared from run to run. Phases that are
+/// also part of a bigger one are listed, indented, under it and not counted
+/// again in the total.
+///
+/// Inputs are read the way told reads them, with add_objects resolving each
+/// module's symbols while the rest are still being parsed. Parsing all of them
+/// first and resolving afterwards is timed too, under "add_objects" and
+/// "resolve_symbols", to show what the overlap saves.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "parallel.h"
+#include "told.h"
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+struct PhaseTimes {
+  std::vector<std::string> names{};
+  std::unordered_map<std::string, std::vector<double>> runs_ms{};
+  // phase -> the phase it is also a part of.
+  std::unordered_map<std::string, std::string> parents{};
+
+  void time(const std::string &name, const std::function<void()> &phase) {
+    auto start = Clock::now();
+    phase();
+    auto end = Clock::now();
+    if (!runs_ms.contains(name))
+      names.push_back(name);
+    runs_ms[name].push_back(
+        std::chrono::duration<double, std::milli>(end - start).count());
+  }
+
+  // Times `name` on its own although `parent` does the same work again, or
+  // the same job a different way.
+  void time_within(const std::string &parent, const std::string &name,
+                   const std::function<void()> &phase) {
+    parents[name] = parent;
+    time(name, phase);
+  }
+};
+
+std::vector<std::string> expand_inputs(const std::vector<std::string> &args) {
+  std::vector<std::string> paths{};
+  for (const auto &arg : args) {
+    if (!fs::is_directory(arg)) {
+      paths.push_back(arg);
+      continue;
+    }
+    std::vector<std::string> objects{};
+    for (const auto &entry : fs::directory_iterator(arg))
+      if (entry.path().extension() == ".o")
+        objects.push_back(entry.path().string());
+    // numeric-aware enough for obj_N.o: shorter names first.
+    std::sort(objects.begin(), objects.end(),
+              [](const std::string &a, const std::string &b) {
+                return a.size() != b.size() ? a.size() < b.size() : a < b;
+              });
+    paths.insert(paths.end(), objects.begin(), objects.end());
+  }
+  return paths;
+}
+
+void run_link(const std::vector<std::string> &paths, const std::string &output,
+              const told::LinkOptions &options, PhaseTimes &times) {
+  {
+    std::vector<elf::ElfBinary> parsed{};
+    times.time_within("add_objects", "parse_objects (all, then resolve)",
+                      [&]() { parsed = told::parse_objects(paths); });
+    told::Executable batch =
+        told::init_exec(std::string{output}, std::move(parsed), {}, options);
+    times.time_within("resolve_symbols", "resolve_symbols (after that)",
+                      [&]() { told::resolve_symbols(batch); });
+  }
+
+  told::Executable e = told::init_exec(std::string{output}, {}, {}, options);
+  times.time("add_objects", [&]() { told::add_objects(e, paths); });
+  times.time("resolve_symbols", [&]() { told::resolve_symbols(e); });
+  if (options.gc_sections)
+    times.time("gc_sections", [&]() { told::gc_sections(e); });
+  if (options.icf)
+    times.time("fold_identical_code",
+               [&]() { told::fold_identical_code(e); });
+  times.time("compute_output_offsets",
+             [&]() { told::compute_output_offsets(e); });
+  times.time("merge_sections", [&]() { told::merge_sections(e); });
+  times.time("create_got", [&]() { told::create_got(e); });
+  times.time("apply_addrs_and_adjustments_to_segments",
+             [&]() { told::apply_addrs_and_adjustments_to_segments(e); });
+  times.time("apply_addrs_to_symbols",
+             [&]() { told::apply_addrs_to_symbols(e); });
+  times.time("apply_headers", [&]() { told::apply_headers(e); });
+
+  // write_out relocates as it writes, so relocation is also timed on its own
+  // against an in-memory image of the output file, as a part of write_out.
+  std::vector<char> image(e.elf_header.e_shoff);
+  for (size_t m = 0; m < e.modules.size(); ++m) {
+    const elf::ElfBinary &mod = e.modules[m];
+    const std::vector<size_t> &offsets = e.section_offsets[m];
+    for (size_t s = 0; s < offsets.size(); ++s) {
+      const elf::InputSection &sec = mod.input_sections[s];
+      if (!e.kept(m, s) || sec.type == elf::SectionType::Bss)
+        continue;
+      std::memcpy(image.data() + e.segment(sec.type).file_offset + offsets[s],
+                  sec.data.data(), sec.data.size());
+    }
+  }
+  times.time_within("write_out", "apply_relocations",
+                    [&]() { told::apply_relocations(e, image.data()); });
+  times.time("write_out", [&]() { told::write_out(e); });
+}
+
+int main(int argc, char *argv[]) {
+  size_t repeat = 5;
+  std::string output = (fs::temp_directory_path() / "told_bench.out").string();
+  bool keep_output = false;
+  told::LinkOptions options{};
+  std::vector<std::string> args{};
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg{argv[i]};
+    if (arg.starts_with("--repeat=")) {
+      repeat = std::stoul(std::string{arg.substr(9)});
+    } else if (arg.starts_with("--threads=")) {
+      told::set_thread_count(std::stoul(std::string{arg.substr(10)}));
+    } else if (arg.starts_with("--keep-output=")) {
+      output = arg.substr(14);
+      keep_output = true;
+    } else if (told::parse_link_option(arg, options)) {
+      continue;
+    } else {
+      args.emplace_back(arg);
+    }
+  }
+  std::vector<std::string> paths = expand_inputs(args);
+  if (paths.empty() || repeat == 0) {
+    std::cerr << "usage: told_bench [--repeat=N] [--threads=N] "
+                 "[--keep-output=FILE] [LINK OPTION].. INPUT..\n";
+    return 1;
+  }
+
+  PhaseTimes times{};
+  try {
+    for (size_t r = 0; r < repeat; ++r)
+      run_link(paths, output, options, times);
+  } catch (const std::exception &err) {
+    std::cerr << "told_bench: " << err.what() << "\n";
+    return 1;
+  }
+  if (!keep_output)
+    fs::remove(output);
+
+  std::printf("%zu inputs, %zu threads, best and median of %zu runs\n",
+              paths.size(), told::thread_count(), repeat);
+  std::printf("%-40s %12s %12s\n", "phase", "best (ms)", "median (ms)");
+  double best_total{}, median_total{};
+  auto print_row = [&](const std::string &label, const std::string &name) {
+    std::vector<double> &runs = times.runs_ms[name];
+    std::sort(runs.begin(), runs.end());
+    std::printf("%-40s %12.3f %12.3f\n", label.c_str(), runs.front(),
+                runs[runs.size() / 2]);
+  };
+  for (const auto &name : times.names) {
+    if (times.parents.contains(name))
+      continue;
+    print_row(name, name);
+    const std::vector<double> &runs = times.runs_ms[name];
+    best_total += runs.front();
+    median_total += runs[runs.size() / 2];
+    for (const auto &[child, parent] : times.parents)
+      if (parent == name)
+        print_row("  " + child, child);
+  }
+  std::printf("%-40s %12.3f %12.3f\n", "total", best_total, median_total);
+}
@@ -0,0 +1,166 @@
+// Only built with -DTOLD_ALLOC_PROFILE=ON, see alloc_profile.h.
+#include "alloc_profile.h"
+
+#include <malloc.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+namespace told {
+
+namespace {
+
+// Phases are kept in fixed arrays, set up before main: operator new can't
+// allocate to record an allocation, and runs before any constructor could.
+constexpr size_t MAX_PHASES = 256;
+
+struct PhaseCounts {
+  std::atomic<uint64_t> allocs;
+  std::atomic<uint64_t> bytes;
+  // highest the live heap got while the phase (or one nested in it) ran.
+  std::atomic<uint64_t> peak_live;
+  uint64_t live_after;
+  long peak_rss_kb;
+  size_t depth;
+};
+
+// row 0 takes whatever is allocated outside of every phase.
+const char *phase_names[MAX_PHASES] = {"(no phase)"};
+PhaseCounts phases[MAX_PHASES];
+std::atomic<size_t> phase_count{1};
+std::atomic<size_t> current_phase{0};
+size_t current_depth = 0;
+
+std::atomic<uint64_t> live_bytes{0};
+
+void raise_to(std::atomic<uint64_t> &peak, uint64_t value) {
+  uint64_t p = peak.load(std::memory_order_relaxed);
+  while (value > p && !peak.compare_exchange_weak(p, value))
+    ;
+}
+
+void *counted_alloc(size_t n, size_t align) {
+  n = std::max<size_t>(n, 1);
+  // aligned_alloc wants a multiple of the alignment.
+  void *p = align <= alignof(std::max_align_t)
+                ? std::malloc(n)
+                : std::aligned_alloc(align, (n + align - 1) / align * align);
+  if (p == nullptr)
+    throw std::bad_alloc{};
+  const size_t size = malloc_usable_size(p);
+  const uint64_t live =
+      live_bytes.fetch_add(size, std::memory_order_relaxed) + size;
+  PhaseCounts &phase = phases[current_phase.load(std::memory_order_relaxed)];
+  phase.allocs.fetch_add(1, std::memory_order_relaxed);
+  phase.bytes.fetch_add(size, std::memory_order_relaxed);
+  raise_to(phase.peak_live, live);
+  return p;
+}
+
+void counted_free(void *p) {
+  if (p == nullptr)
+    return;
+  live_bytes.fetch_sub(malloc_usable_size(p), std::memory_order_relaxed);
+  std::free(p);
+}
+
+long peak_rss_kb() {
+  rusage usage{};
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+double mb(uint64_t bytes) { return static_cast<double>(bytes) / (1 << 20); }
+
+} // namespace
+
+AllocPhase::AllocPhase(const char *name)
+    : index_(phase_count.load()), parent_(current_phase.load()) {
+  // past the last row, allocations stay with the enclosing phase.
+  if (index_ == MAX_PHASES) {
+    index_ = parent_;
+    return;
+  }
+  phase_names[index_] = name;
+  phases[index_].peak_live.store(live_bytes.load());
+  phases[index_].depth = current_depth++;
+  phase_count.store(index_ + 1);
+  current_phase.store(index_);
+}
+
+AllocPhase::~AllocPhase() {
+  if (index_ == parent_)
+    return;
+  PhaseCounts &phase = phases[index_];
+  phase.live_after = live_bytes.load();
+  phase.peak_rss_kb = peak_rss_kb();
+  raise_to(phases[parent_].peak_live, phase.peak_live.load());
+  --current_depth;
+  current_phase.store(parent_);
+}
+
+void print_alloc_profile(std::ostream &out) {
+  char line[160];
+  std::snprintf(line, sizeof(line), "%-44s %10s %12s %10s %10s %10s\n",
+                "phase", "allocs", "alloc'd MB", "peak MB", "after MB",
+                "RSS MB");
+  out << "told: -- allocations by phase (peak is of the live heap, RSS is the"
+         " process's peak once the phase was done):\n"
+      << line;
+  const size_t n = phase_count.load();
+  for (size_t i = 0; i < n; ++i) {
+    const PhaseCounts &phase = phases[i];
+    // phases still running have no end state yet.
+    char after[32] = "-";
+    char rss[32] = "-";
+    if (i != 0 && phase.peak_rss_kb != 0) {
+      std::snprintf(after, sizeof(after), "%.1f", mb(phase.live_after));
+      std::snprintf(rss, sizeof(rss), "%.1f",
+                    static_cast<double>(phase.peak_rss_kb) / 1024);
+    }
+    const auto indent = static_cast<int>(phase.depth * 2);
+    std::snprintf(line, sizeof(line),
+                  "%*s%-*s %10" PRIu64 " %12.1f %10.1f %10s %10s\n", indent,
+                  "", 44 - indent, phase_names[i], phase.allocs.load(),
+                  mb(phase.bytes.load()), mb(phase.peak_live.load()), after,
+                  rss);
+    out << line;
+  }
+  std::snprintf(line, sizeof(line), "peak RSS: %.1f MB\n",
+                static_cast<double>(peak_rss_kb()) / 1024);
+  out << line;
+}
+
+} // namespace told
+
+void *operator new(size_t n) { return told::counted_alloc(n, 0); }
+void *operator new[](size_t n) { return told::counted_alloc(n, 0); }
+void *operator new(size_t n, std::align_val_t align) {
+  return told::counted_alloc(n, static_cast<size_t>(align));
+}
+void *operator new[](size_t n, std::align_val_t align) {
+  return told::counted_alloc(n, static_cast<size_t>(align));
+}
+void operator delete(void *p) noexcept { told::counted_free(p); }
+void operator delete[](void *p) noexcept { told::counted_free(p); }
+void operator delete(void *p, size_t) noexcept { told::counted_free(p); }
+void operator delete[](void *p, size_t) noexcept { told::counted_free(p); }
+void operator delete(void *p, std::align_val_t) noexcept {
+  told::counted_free(p);
+}
+void operator delete[](void *p, std::align_val_t) noexcept {
+  told::counted_free(p);
+}
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+  told::counted_free(p);
+}
+void operator delete[](void *p, size_t, std::align_val_t) noexcept {
+  told::counted_free(p);
+}
@@ -0,0 +1,47 @@
+/// Allocation profiling, built in with -DTOLD_ALLOC_PROFILE=ON.
+///
+/// Such a build replaces the global operator new and delete with ones that
+/// count every allocation against the link phase running at the time, and
+/// told prints, per phase, how many allocations were made, how many bytes
+/// they asked for and the highest the live heap got, next to the process's
+/// peak RSS once the phase was over. In every other build AllocPhase is empty
+/// and costs nothing.
+#pragma once
+
+#include <ostream>
+
+namespace told {
+
+#ifdef TOLD_ALLOC_PROFILE
+
+// Makes `name` the phase allocations count against, on every thread, until
+// it is destroyed. Phases nest, allocations count against the innermost one.
+// Only meant for the thread driving the link; `name` must outlive the run.
+class AllocPhase {
+ public:
+  explicit AllocPhase(const char *name);
+  ~AllocPhase();
+
+  AllocPhase(const AllocPhase &) = delete;
+  AllocPhase &operator=(const AllocPhase &) = delete;
+
+ private:
+  size_t index_;
+  size_t parent_;
+};
+
+// Writes a row for every phase that has run so far, in the order they began.
+void print_alloc_profile(std::ostream &out);
+
+#else
+
+class AllocPhase {
+ public:
+  explicit AllocPhase(const char *) {}
+};
+
+inline void print_alloc_profile(std::ostream &) {}
+
+#endif
+
+} // namespace told
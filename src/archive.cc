@@ -0,0 +1,194 @@
+#include "archive.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "stats.h"
+
+namespace fs = std::filesystem;
+
+namespace elf {
+
+constexpr std::string_view AR_MAGIC = "!<arch>\n";
+constexpr std::string_view AR_THIN_MAGIC = "!<thin>\n";
+
+// Every member starts with one of these, all fields are space-padded ASCII.
+struct ArMemberHeader {
+  char ar_name[16];
+  char ar_date[12];
+  char ar_uid[6];
+  char ar_gid[6];
+  char ar_mode[8];
+  char ar_size[10];
+  char ar_fmag[2]; /* "`\n" */
+};
+
+struct Member {
+  std::string_view name; // raw ar_name, trailing spaces stripped
+  size_t data_offset;
+  size_t size;
+};
+
+void expect_ar(bool cond, const char *what) {
+  if (!cond)
+    throw ParseError(what);
+}
+
+std::string_view trim_right(std::string_view s) {
+  while (!s.empty() && s.back() == ' ')
+    s.remove_suffix(1);
+  return s;
+}
+
+// Reads the header of the member at `offset`.
+Member member_at(std::string_view file, size_t offset) {
+  expect_ar(offset <= file.size() &&
+                file.size() - offset >= sizeof(ArMemberHeader),
+            "archive member header is truncated");
+  ArMemberHeader hdr{};
+  std::memcpy(&hdr, file.data() + offset, sizeof(hdr));
+  expect_ar(hdr.ar_fmag[0] == '`' && hdr.ar_fmag[1] == '\n',
+            "bad archive member header");
+  std::string_view size_field = trim_right({hdr.ar_size, sizeof(hdr.ar_size)});
+  size_t size{};
+  auto [ptr, ec] = std::from_chars(
+      size_field.data(), size_field.data() + size_field.size(), size);
+  expect_ar(ec == std::errc{} && ptr == size_field.data() + size_field.size(),
+            "bad archive member size");
+  size_t data_offset = offset + sizeof(ArMemberHeader);
+  expect_ar(size <= file.size() - data_offset, "archive member is truncated");
+  return Member{trim_right({file.data() + offset, sizeof(hdr.ar_name)}),
+                data_offset, size};
+}
+
+size_t next_member(const Member &m) {
+  // member data is padded to an even offset.
+  return m.data_offset + m.size + (m.size & 1);
+}
+
+template <typename Word>
+Word read_be(const char *p) {
+  Word v{};
+  for (size_t i = 0; i < sizeof(Word); ++i)
+    v = static_cast<Word>((v << 8) | static_cast<unsigned char>(p[i]));
+  return v;
+}
+
+// Reads a GNU symbol index: a big-endian count, that many member header
+// offsets, then that many NUL-terminated names.
+template <typename Word>
+void parse_index(Archive &ar, std::string_view table) {
+  expect_ar(table.size() >= sizeof(Word), "archive index is truncated");
+  Word count = read_be<Word>(table.data());
+  expect_ar(count <= (table.size() - sizeof(Word)) / sizeof(Word),
+            "archive index is truncated");
+  const char *offsets = table.data() + sizeof(Word);
+  std::string_view names = table.substr(sizeof(Word) * (count + 1));
+  ar.index.reserve(count);
+  for (Word i = 0; i < count; ++i) {
+    size_t end = names.find('\0');
+    expect_ar(end != std::string_view::npos, "archive index is truncated");
+    ar.index.try_emplace(names.substr(0, end),
+                         read_be<Word>(offsets + i * sizeof(Word)));
+    names.remove_prefix(end + 1);
+  }
+}
+
+bool is_archive(const std::string &path) {
+  char magic[AR_MAGIC.size()];
+  int fd = ::open(path.c_str(), O_RDONLY);
+  told::add_stat(told::Stat::InputSyscalls, fd < 0 ? 1 : 3);
+  if (fd < 0)
+    return false;
+  ssize_t n = read(fd, magic, sizeof(magic));
+  close(fd);
+  if (n != static_cast<ssize_t>(sizeof(magic)))
+    return false;
+  // thin archives count too, so that parse_archive can reject them by name.
+  std::string_view m{magic, sizeof(magic)};
+  return m == AR_MAGIC || m == AR_THIN_MAGIC;
+}
+
+Archive parse_archive(const std::string &path) {
+  const fs::path ar_path{path};
+  if (!fs::exists(ar_path))
+    throw ParseError(path + ": input archive does not exist");
+
+  Archive ar{};
+  ar.path = path;
+  try {
+    ar.mapping = MappedFile::open(fs::canonical(ar_path));
+    std::string_view file{ar.mapping->data(), ar.mapping->size()};
+    expect_ar(!file.starts_with(AR_THIN_MAGIC),
+              "thin archives are not supported");
+    expect_ar(file.starts_with(AR_MAGIC), "not an archive");
+
+    // the index and long name table, when present, are the first members.
+    bool has_index = false;
+    size_t offset = AR_MAGIC.size();
+    while (offset < file.size()) {
+      Member m = member_at(file, offset);
+      std::string_view data = file.substr(m.data_offset, m.size);
+      if (m.name == "/") {
+        parse_index<uint32_t>(ar, data);
+        has_index = true;
+      } else if (m.name == "/SYM64/") {
+        parse_index<uint64_t>(ar, data);
+        has_index = true;
+      } else if (m.name == "//") {
+        ar.long_names = data;
+      } else {
+        break;
+      }
+      offset = next_member(m);
+    }
+    expect_ar(has_index, "archive has no symbol index (run ranlib on it)");
+  } catch (const ParseError &err) {
+    throw ParseError(path + ": " + err.what());
+  }
+  return ar;
+}
+
+// Resolves a member's name, which is either "name/" or "/N", an offset into
+// the long name table where the name is terminated by "/\n".
+std::string_view member_name(const Archive &ar, const Member &m) {
+  std::string_view name = m.name;
+  if (name.size() > 1 && name.front() == '/') {
+    size_t offset{};
+    auto [ptr, ec] =
+        std::from_chars(name.data() + 1, name.data() + name.size(), offset);
+    expect_ar(ec == std::errc{} && offset < ar.long_names.size(),
+              "bad archive long member name");
+    name = ar.long_names.substr(offset);
+    name = name.substr(0, name.find('\n'));
+  }
+  if (name.ends_with('/'))
+    name.remove_suffix(1);
+  return name;
+}
+
+ElfBinary parse_archive_member(const Archive &archive, size_t offset) {
+  Member m{};
+  std::string name{};
+  try {
+    std::string_view file{archive.mapping->data(), archive.mapping->size()};
+    m = member_at(file, offset);
+    name = archive.path + "(" + std::string{member_name(archive, m)} + ")";
+  } catch (const ParseError &err) {
+    throw ParseError(archive.path + ": " + err.what());
+  }
+  return parse_object_in(archive.mapping,
+                         BlockView{archive.mapping->data() + m.data_offset,
+                                   m.size},
+                         name);
+}
+
+} // namespace elf
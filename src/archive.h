@@ -0,0 +1,39 @@
+/// Reader for static archives (.a) as written by GNU ar.
+///
+/// Only the archive's symbol index is read up front. Members are parsed on
+/// demand, when resolution finds a symbol that the index says they define.
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "elf_utils.h"
+
+namespace elf {
+
+struct Archive {
+  std::string path;
+  std::shared_ptr<const MappedFile> mapping;
+  // symbol -> offset of the header of the member defining it. Names view the
+  // index in `mapping`. If more than one member claims a symbol, the first
+  // one wins, like in ld.
+  std::unordered_map<Symbol, size_t> index;
+  // the "//" member holding names too long for a member header, if any.
+  std::string_view long_names;
+};
+
+// Returns true if the file at `path` starts with an archive magic.
+bool is_archive(const std::string &path);
+
+// Maps the archive at `path` and reads its symbol index. Throws ParseError
+// for thin archives and archives without an index (see `ar s`).
+Archive parse_archive(const std::string &path);
+
+// Parses the member whose header is at `offset`. The module is called
+// "archive(member)".
+ElfBinary parse_archive_member(const Archive &archive, size_t offset);
+
+} // namespace elf
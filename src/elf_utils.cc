@@ -1,26 +1,42 @@
 #include "elf_utils.h"
 
-#include <cassert>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
 #include <cstdint>
 #include <cstring>
 #include <filesystem>
-#include <fstream>
 #include <iostream>
+#include <span>
+#include <stdexcept>
 #include <string>
-#include <unordered_map>
+#include <string_view>
 #include <utility>
 #include <vector>
 
+#include "stats.h"
+
 namespace fs = std::filesystem;
 
 namespace elf {
 
-SectionType s_type_from_name(const std::string &n) {
+SectionType s_type_from_name(std::string_view n) {
   // std::cout << "name of section header: " << n << std::endl;
-  if (n == ".text") {
+  auto is = [n](std::string_view prefix) {
+    return n == prefix || (n.starts_with(prefix) && n[prefix.size()] == '.');
+  };
+  if (is(".text")) {
     return SectionType::Text;
-  } else if (n == ".data") {
+  } else if (is(".data")) {
     return SectionType::Data;
+  } else if (is(".rodata")) {
+    return SectionType::RoData;
+  } else if (is(".bss")) {
+    return SectionType::Bss;
   } else if (n == ".symtab") {
     return SectionType::SymTable;
   } else if (n == ".strtab") {
@@ -31,140 +47,291 @@ SectionType s_type_from_name(const std::string &n) {
   return SectionType::None;
 }
 
-void parse_section_headers(ElfBinary &module) {
-  std::ifstream obj_file{module.given_path, std::ios::binary};
-
-  obj_file.seekg(module.elf_header.e_shoff);
-  std::vector<ElfSectionHeader> s_headers(module.elf_header.e_shnum);
-  for (size_t i = 0; i < module.elf_header.e_shnum; ++i) {
-    obj_file.read(reinterpret_cast<char *>(&s_headers[i]),
-                  sizeof(ElfSectionHeader));
+std::shared_ptr<const MappedFile> MappedFile::open(const std::string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw ParseError(std::string{"could not open: "} + std::strerror(errno));
+  }
+  struct stat st {};
+  if (fstat(fd, &st) != 0) {
+    int err = errno;
+    close(fd);
+    throw ParseError(std::string{"could not stat: "} + std::strerror(err));
   }
+  size_t size = static_cast<size_t>(st.st_size);
+  void *data = nullptr;
+  if (size != 0) {
+    data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      int err = errno;
+      close(fd);
+      throw ParseError(std::string{"could not mmap: "} + std::strerror(err));
+    }
+  }
+  // the mapping stays valid after the descriptor is gone.
+  close(fd);
+  // open, fstat, mmap (of a non-empty file) and close.
+  told::add_stat(told::Stat::InputSyscalls, size != 0 ? 4 : 3);
+  told::add_input_stat(path, size);
+  return std::shared_ptr<const MappedFile>(
+      new MappedFile(static_cast<const char *>(data), size, false));
+}
 
-  std::unordered_map<SectionType, ElfSectionHeader>
-      section_headers_with_types{};
-  section_headers_with_types.reserve(s_headers.size());
-  uint64_t shstr_offset = s_headers[module.elf_header.e_shstrndx].sh_offset;
-  for (size_t i = 0; i < s_headers.size(); ++i) {
-    std::string name{};
-    obj_file.seekg(shstr_offset + s_headers[i].sh_name);
-    std::getline(obj_file, name, '\0');
-    section_headers_with_types.emplace(s_type_from_name(name), s_headers[i]);
+std::shared_ptr<const MappedFile>
+MappedFile::copy_of(std::span<const char> bytes) {
+  // operator new[] memory is aligned for any of the ELF structures.
+  char *data = new char[bytes.size()];
+  std::memcpy(data, bytes.data(), bytes.size());
+  return std::shared_ptr<const MappedFile>(
+      new MappedFile(data, bytes.size(), true));
+}
+
+MappedFile::~MappedFile() {
+  if (owned_) {
+    delete[] data_;
+  } else if (data_ != nullptr) {
+    munmap(const_cast<char *>(data_), size_);
+    told::add_stat(told::Stat::InputSyscalls, 1);
   }
+}
 
-  module.section_headers = std::move(section_headers_with_types);
+void expect(bool cond, const char *what) {
+  if (!cond)
+    throw ParseError(what);
 }
 
-void parse_block_sections(ElfBinary &module) {
-  std::ifstream obj_file{module.given_path, std::ios::binary};
+// Returns a view of `count` T's at `offset` into the module's contents.
+template <typename T>
+std::span<const T> view_at(const ElfBinary &module, size_t offset,
+                           size_t count) {
+  expect(offset <= module.contents.size() &&
+             count <= (module.contents.size() - offset) / sizeof(T),
+         "object file is truncated");
+  const char *p = module.contents.data() + offset;
+  expect(reinterpret_cast<uintptr_t>(p) % alignof(T) == 0,
+         "misaligned structure in object file");
+  return {reinterpret_cast<const T *>(p), count};
+}
 
-  std::unordered_map<SectionType, Block> sections_with_types;
-  sections_with_types.reserve(module.section_headers.size());
-  for (const auto &sh : module.section_headers) {
-    if (sh.first != SectionType::Text) // are there other sections are basically
-                                       // just blocks of data?
+// Reads the NUL-terminated string at `offset` into the given string table.
+std::string_view string_at(const ElfBinary &module,
+                           const ElfSectionHeader &str_table_header,
+                           Elf64_Word offset) {
+  BlockView table = view_at<char>(module, str_table_header.sh_offset,
+                                  str_table_header.sh_size);
+  expect(offset < table.size(), "string table index out of range");
+  const char *s = table.data() + offset;
+  return {s, strnlen(s, table.size() - offset)};
+}
+
+void parse_section_headers(ElfBinary &module) {
+  std::span<const ElfSectionHeader> s_headers = view_at<ElfSectionHeader>(
+      module, module.elf_header.e_shoff, module.elf_header.e_shnum);
+
+  const ElfSectionHeader &shstr_header =
+      s_headers[module.elf_header.e_shstrndx];
+  // the null section at index 0 is never one of the named types.
+  for (size_t i = 1; i < s_headers.size(); ++i) {
+    std::string_view name =
+        string_at(module, shstr_header, s_headers[i].sh_name);
+    Elf64_Section &index = module.section_indices[s_type_from_name(name)];
+    if (index == SHN_UNDEF)
+      index = static_cast<Elf64_Section>(i);
+  }
+  module.section_header_table = s_headers;
+}
+
+// Whether a section named like an input section of `type` really is one.
+bool is_input_section(SectionType type, const ElfSectionHeader &sh) {
+  const Elf64_Xword flags =
+      sh.sh_flags & (SHF_ALLOC | SHF_WRITE | SHF_EXECINSTR);
+  switch (type) {
+  case SectionType::Text:
+    return sh.sh_type == SHT_PROGBITS &&
+           (flags & (SHF_ALLOC | SHF_EXECINSTR)) ==
+               (SHF_ALLOC | SHF_EXECINSTR);
+  case SectionType::RoData:
+    return sh.sh_type == SHT_PROGBITS && flags == SHF_ALLOC;
+  case SectionType::Data:
+    return sh.sh_type == SHT_PROGBITS && flags == (SHF_ALLOC | SHF_WRITE);
+  case SectionType::Bss:
+    return sh.sh_type == SHT_NOBITS && flags == (SHF_ALLOC | SHF_WRITE);
+  default:
+    return false;
+  }
+}
+
+// Collects the sections that make it into the output.
+void parse_input_sections(ElfBinary &module) {
+  const std::span<const ElfSectionHeader> s_headers =
+      module.section_header_table;
+  const ElfSectionHeader &shstr_header =
+      s_headers[module.elf_header.e_shstrndx];
+  module.input_section_index.assign(s_headers.size(), NO_INPUT_SECTION);
+  for (size_t i = 0; i < s_headers.size(); ++i) {
+    const ElfSectionHeader &sh = s_headers[i];
+    std::string_view name = string_at(module, shstr_header, sh.sh_name);
+    SectionType type = s_type_from_name(name);
+    // TODO: are there other sections that are basically just blocks of data?
+    if (!is_input_section(type, sh))
       continue;
-    Block section_data_buffer(sh.second.sh_size);
-    obj_file.seekg(sh.second.sh_offset);
-    obj_file.read(section_data_buffer.data(), sh.second.sh_size);
-    sections_with_types.emplace(sh.first, std::move(section_data_buffer));
+    module.input_section_index[i] =
+        static_cast<uint32_t>(module.input_sections.size());
+    // .bss only has a size, there's nothing to view.
+    BlockView data = type == SectionType::Bss
+                         ? BlockView{}
+                         : view_at<char>(module, sh.sh_offset, sh.sh_size);
+    module.input_sections.push_back(InputSection{
+        name, static_cast<Elf64_Section>(i), type, data, sh.sh_size,
+        sh.sh_addralign == 0 ? 1 : sh.sh_addralign, 0, 0});
   }
-  module.sections = std::move(sections_with_types);
 }
 
 void parse_symbol_table(ElfBinary &module) {
-  std::ifstream obj_file{module.given_path, std::ios::binary};
-
-  std::unordered_map<Symbol, ElfSymbolTableEntry> sym_table;
-  ElfSectionHeader sym_table_header =
-      module.section_headers.at(SectionType::SymTable);
-  ElfSectionHeader str_table_header =
-      module.section_headers.at(SectionType::StrTable);
-  for (size_t i = 0; i < sym_table_header.sh_size;
-       i += sym_table_header.sh_entsize) {
-    obj_file.seekg(sym_table_header.sh_offset + i);
-    ElfSymbolTableEntry ste{};
-    obj_file.read(reinterpret_cast<char *>(&ste), sizeof(ElfSymbolTableEntry));
-    module.symtab_entries.push_back(ste);
-    // std::cout << "symbol table st_name: " << ste.st_name << std::endl;
-    obj_file.seekg(str_table_header.sh_offset + ste.st_name);
-    Symbol s_name{};
-    std::getline(obj_file, s_name, '\0');
-    if (!s_name.empty()) {
-      // std::cout << "symbol table name: " << s_name << std::endl;
-      // std::cout << "  symbol table st_bind: " << ELF64_ST_BIND(ste.st_info)
-      //           << " st_type: " << ELF64_ST_TYPE(ste.st_info) << std::endl;
-      sym_table.emplace(std::move(s_name), std::move(ste));
-    }
+  const ElfSectionHeader *sym_table =
+      module.section_header(SectionType::SymTable);
+  const ElfSectionHeader *str_table =
+      module.section_header(SectionType::StrTable);
+  expect(sym_table != nullptr && str_table != nullptr,
+         "missing .symtab or .strtab section");
+  const ElfSectionHeader &sym_table_header = *sym_table;
+  const ElfSectionHeader &str_table_header = *str_table;
+  expect(sym_table_header.sh_entsize == sizeof(ElfSymbolTableEntry),
+         "unexpected symbol table entry size");
+  module.symtab_entries = view_at<ElfSymbolTableEntry>(
+      module, sym_table_header.sh_offset,
+      sym_table_header.sh_size / sizeof(ElfSymbolTableEntry));
+  module.symbol_names.reserve(module.symtab_entries.size());
+  module.symbol_hashes.reserve(module.symtab_entries.size());
+  for (const auto &ste : module.symtab_entries) {
+    Symbol s_name = string_at(module, str_table_header, ste.st_name);
+    module.symbol_names.push_back(s_name);
+    module.symbol_hashes.push_back(
+        ELF64_ST_BIND(ste.st_info) == STB_LOCAL ? 0 : symbol_hash(s_name));
   }
-  module.symbol_table = std::move(sym_table);
 }
 
+// Decodes the SHT_RELA section for every input section that has one.
+// Relocations for anything else (.eh_frame, debug info) are dropped along with
+// the sections they apply to.
 void parse_relocation_entries(ElfBinary &module) {
-  if (auto rela_section = module.section_headers.find(SectionType::Rela);
-      rela_section != module.section_headers.end()) {
-    std::ifstream obj_file{module.given_path, std::ios::binary};
-    std::unordered_map<Symbol, ElfRelocAddendEntry> rela_entries{};
-    ElfSectionHeader str_table_header =
-        module.section_headers.at(SectionType::StrTable);
-    for (size_t i = 0; i < rela_section->second.sh_size;
-         i += rela_section->second.sh_entsize) {
-      obj_file.seekg(rela_section->second.sh_offset + i);
-      ElfRelocAddendEntry reloc_add{};
-      obj_file.read(reinterpret_cast<char *>(&reloc_add),
-                    sizeof(ElfRelocAddendEntry));
-
-      // Search for symbol name. maybe there is a better way to organize
-      // ElfBinary to make this search more straighforward.
-      ElfSymbolTableEntry ste =
-          module.symtab_entries.at(ELF64_R_SYM(reloc_add.r_info));
-      obj_file.seekg(str_table_header.sh_offset + ste.st_name);
-      Symbol s_name{};
-      std::getline(obj_file, s_name, '\0');
-
-      rela_entries.emplace(std::move(s_name), std::move(reloc_add));
+  std::vector<const ElfSectionHeader *> rela_for(module.input_sections.size());
+  const size_t section_count = module.input_section_index.size();
+  for (const auto &sh : module.section_header_table) {
+    if (sh.sh_type != SHT_RELA || sh.sh_info >= section_count)
+      continue;
+    uint32_t target = module.input_section_index[sh.sh_info];
+    if (target != NO_INPUT_SECTION)
+      rela_for[target] = &sh;
+  }
+
+  std::vector<Relocation> relocations{};
+  for (size_t i = 0; i < module.input_sections.size(); ++i) {
+    InputSection &section = module.input_sections[i];
+    section.reloc_begin = static_cast<uint32_t>(relocations.size());
+    if (rela_for[i] != nullptr) {
+      expect(section.type != SectionType::Bss,
+             "relocations against a section without contents");
+      const ElfSectionHeader &rela = *rela_for[i];
+      expect(rela.sh_entsize == sizeof(ElfRelocAddendEntry),
+             "unexpected relocation entry size");
+      std::span<const ElfRelocAddendEntry> relocs =
+          view_at<ElfRelocAddendEntry>(
+              module, rela.sh_offset,
+              rela.sh_size / sizeof(ElfRelocAddendEntry));
+      for (const auto &reloc_add : relocs) {
+        expect(ELF64_R_SYM(reloc_add.r_info) < module.symtab_entries.size(),
+               "relocation symbol index out of range");
+        relocations.push_back(Relocation{
+            reloc_add.r_offset,
+            static_cast<Elf64_Word>(ELF64_R_TYPE(reloc_add.r_info)),
+            static_cast<Elf64_Word>(ELF64_R_SYM(reloc_add.r_info)),
+            reloc_add.r_addend});
+      }
     }
-    module.rela_entries = std::move(rela_entries);
+    section.reloc_end = static_cast<uint32_t>(relocations.size());
+    // compilers already emit them in order, so this is usually just a check.
+    auto by_offset = [](const Relocation &a, const Relocation &b) {
+      return a.offset < b.offset;
+    };
+    auto begin =
+        relocations.begin() + static_cast<ptrdiff_t>(section.reloc_begin);
+    if (!std::is_sorted(begin, relocations.end(), by_offset))
+      std::stable_sort(begin, relocations.end(), by_offset);
   }
+  module.relocations = std::move(relocations);
 }
 
 ElfBinary parse_object(const std::string &file_path) {
   const fs::path obj_path{file_path};
-  assert(fs::exists(obj_path) && "Input object file needs to exist");
+  if (!fs::exists(obj_path))
+    throw ParseError(file_path + ": input object file does not exist");
 
   fs::path canonicalized_path = fs::canonical(obj_path);
-  ElfBinary module{canonicalized_path};
-  std::ifstream obj_file{module.given_path, std::ios::binary};
-  // N.B. - ifstream read doesn't actually handle endianness, it just
-  //        reads the bytes in the order they're stored and interprets
-  //        based on native endianness (so in this case, since I'm
-  //        mostly testing this code on my debian x64 machine, it just
-  //        so happens that it interprets the bytes in the way that I
-  //        want).
-  //        For the purposes of this toy linker - this is okay.
-  obj_file.read(reinterpret_cast<char *>(&module.elf_header),
-                sizeof(ElfHeader));
-  assert_expected_elf_header(module.elf_header);
-
-  parse_section_headers(module);
-  parse_block_sections(module);
-  parse_symbol_table(module);
-  parse_relocation_entries(module);
+  // Map the whole object once; every later parse step reads through views
+  // into this mapping rather than seeking around in a stream.
+  std::shared_ptr<const MappedFile> mapping{};
+  try {
+    mapping = MappedFile::open(canonicalized_path);
+  } catch (const ParseError &err) {
+    throw ParseError(file_path + ": " + err.what());
+  }
+  BlockView contents{mapping->data(), mapping->size()};
+  ElfBinary module =
+      parse_object_in(std::move(mapping), contents, file_path);
+  return module;
+}
+
+ElfBinary parse_object_in(std::shared_ptr<const MappedFile> mapping,
+                          BlockView contents, const std::string &name) {
+  ElfBinary module{name};
+  const auto base = reinterpret_cast<uintptr_t>(contents.data());
+  if (base % alignof(ElfSectionHeader) != 0) {
+    // archive members are only 2-byte aligned. Reading the ELF structures
+    // out of them in place would be misaligned, so take a copy of just this
+    // member instead.
+    mapping = MappedFile::copy_of(contents);
+    contents = BlockView{mapping->data(), mapping->size()};
+  }
+  module.mapping = std::move(mapping);
+  module.contents = contents;
+  try {
+    // N.B. - this doesn't actually handle endianness, it just reads the bytes
+    //        in the order they're stored and interprets based on native
+    //        endianness (so in this case, since I'm mostly testing this code
+    //        on my debian x64 machine, it just so happens that it interprets
+    //        the bytes in the way that I want).
+    //        For the purposes of this toy linker - this is okay.
+    expect(module.contents.size() >= sizeof(ElfHeader),
+           "file is too small to be an ELF object");
+    std::memcpy(&module.elf_header, module.contents.data(), sizeof(ElfHeader));
+    assert_expected_elf_header(module.elf_header);
+
+    parse_section_headers(module);
+    parse_input_sections(module);
+    parse_symbol_table(module);
+    parse_relocation_entries(module);
+    told::add_stat(told::Stat::SymbolsParsed, module.symtab_entries.size());
+  } catch (const ParseError &err) {
+    throw ParseError(name + ": " + err.what());
+  }
   return module;
 }
 
 // Assert some basic assumptions that linker makes about its given ELF object
-// files.
+// files. Throws a ParseError describing the first one that doesn't hold.
 void assert_expected_elf_header(const ElfHeader &elf_header) {
   unsigned char magic[4]{0x7f, 'E', 'L', 'F'};
-  assert(std::memcmp(magic, elf_header.e_ident, SELFMAG) == 0 &&
-         "Not an ELF file");
-  assert(elf_header.e_ident[EI_CLASS] == ELFCLASS64 && "Not a 64-bit object");
-  assert(elf_header.e_ident[EI_DATA] == ELFDATA2LSB && "Not little-endian");
-  assert(elf_header.e_ident[EI_OSABI] == ELFOSABI_SYSV && "Not SystemV ABI");
-  assert(elf_header.e_machine == EM_X86_64 && "Not AMD x64");
-  assert(elf_header.e_shstrndx != SHN_UNDEF &&
-         "Section header string table section needs to be present");
+  expect(std::memcmp(magic, elf_header.e_ident, SELFMAG) == 0,
+         "not an ELF file");
+  expect(elf_header.e_ident[EI_CLASS] == ELFCLASS64, "not a 64-bit object");
+  expect(elf_header.e_ident[EI_DATA] == ELFDATA2LSB, "not little-endian");
+  expect(elf_header.e_ident[EI_OSABI] == ELFOSABI_SYSV, "not SystemV ABI");
+  expect(elf_header.e_machine == EM_X86_64, "not AMD x64");
+  expect(elf_header.e_shstrndx != SHN_UNDEF,
+         "section header string table section needs to be present");
+  expect(elf_header.e_shstrndx < elf_header.e_shnum,
+         "section header string table index out of range");
   // TODO - add more constraints if necessary
 }
 
@@ -4,10 +4,16 @@
 ///  https://sites.uclouvain.be/SystInfo/usr/include/elf.h.html
 #pragma once
 
+#include <array>
+#include <cstddef>
 #include <cstdint>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <span>
+#include <stdexcept>
 #include <string>
-#include <unordered_map>
+#include <string_view>
 #include <utility>
 #include <vector>
 
@@ -40,18 +46,25 @@
 #define SHT_PROGBITS (1) /* Program data */
 #define SHT_SYMTAB (2)   /* Symbol table */
 #define SHT_STRTAB (3)   /* String table */
+#define SHT_RELA (4)     /* Relocation entries with addends */
+#define SHT_NOTE (7)     /* Notes */
+#define SHT_NOBITS (8)   /* Program space with no data (bss) */
 
 #define SHF_WRITE (1 << 0)     /* Writable */
 #define SHF_ALLOC (1 << 1)     /* Occupies memory during execution */
 #define SHF_EXECINSTR (1 << 2) /* Executable */
+#define SHF_INFO_LINK (1 << 6) /* `sh_info' contains SHT index */
 
 #define PT_NULL (0) /* Program header table entry unused */
 #define PT_LOAD (1) /* Loadable program segment */
+#define PT_NOTE (4) /* Auxiliary information */
 
 #define PF_X (1 << 0) /* Segment is executable */
 #define PF_W (1 << 1) /* Segment is writable */
 #define PF_R (1 << 2) /* Segment is readable */
 
+#define NT_GNU_BUILD_ID (3) /* Unique build ID bitstring */
+
 /* How to extract and insert information held in the st_info field. */
 #define ELF32_ST_BIND(val) (((unsigned char)(val)) >> 4)
 #define ELF32_ST_TYPE(val) ((val) & 0xf)
@@ -98,11 +111,20 @@
 #define ELF64_R_INFO(sym, type) ((((Elf64_Xword)(sym)) << 32) + (type))
 
 /* AMD x86-64 relocations. */
-#define R_X86_64_NONE 0  /* No reloc */
-#define R_X86_64_64 1    /* Direct 64 bit  */
-#define R_X86_64_PC32 2  /* PC relative 32 bit signed */
-#define R_X86_64_GOT32 3 /* 32 bit GOT entry */
-#define R_X86_64_PLT32 4 /* 32 bit PLT address */
+#define R_X86_64_NONE 0       /* No reloc */
+#define R_X86_64_64 1         /* Direct 64 bit  */
+#define R_X86_64_PC32 2       /* PC relative 32 bit signed */
+#define R_X86_64_GOT32 3      /* 32 bit GOT entry */
+#define R_X86_64_PLT32 4      /* 32 bit PLT address */
+#define R_X86_64_COPY 5       /* Copy symbol at runtime */
+#define R_X86_64_GLOB_DAT 6   /* Create GOT entry */
+#define R_X86_64_JUMP_SLOT 7  /* Create PLT entry */
+#define R_X86_64_RELATIVE 8   /* Adjust by program base */
+#define R_X86_64_GOTPCREL 9   /* 32 bit signed PC relative offset to GOT */
+#define R_X86_64_32 10        /* Direct 32 bit zero extended */
+#define R_X86_64_32S 11       /* Direct 32 bit sign extended */
+#define R_X86_64_GOTPCRELX 41 /* GOTPCREL, relaxable */
+#define R_X86_64_REX_GOTPCRELX 42 /* GOTPCREL with REX prefix, relaxable */
 
 namespace elf {
 
@@ -115,9 +137,45 @@ typedef uint64_t Elf64_Addr;
 typedef uint64_t Elf64_Off;
 
 typedef std::vector<char> Block;
-typedef std::string Symbol;
+// Read-only view of section contents, pointing into an input MappedFile.
+typedef std::span<const char> BlockView;
+// Symbol names are never copied out of the input: a Symbol views the name in
+// its object's mapped string table, so it stays valid for as long as the
+// ElfBinary (or any copy of it) holding that mapping is alive. Every table
+// keyed by Symbol shares those bytes instead of owning its own copy.
+typedef std::string_view Symbol;
+
+// Hash the global symbol table is keyed by. Objects compute it once per name
+// while they're parsed, lookups after that don't touch the name's bytes.
+inline uint64_t symbol_hash(Symbol sym) { return std::hash<Symbol>{}(sym); }
+
+// An input file mapped read-only into memory. Parsed objects keep a reference
+// to their mapping and hand out views into it instead of copying bytes, so the
+// mapping lives until the last ElfBinary pointing into it goes away.
+class MappedFile {
+ public:
+  static std::shared_ptr<const MappedFile> open(const std::string &path);
+  // An owned, suitably aligned heap copy of `bytes`, for the rare input that
+  // can't be parsed where it is mapped.
+  static std::shared_ptr<const MappedFile> copy_of(std::span<const char> bytes);
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  ~MappedFile();
+
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  MappedFile(const char *data, size_t size, bool owned)
+      : data_(data), size_(size), owned_(owned) {}
+
+  const char *data_;
+  size_t size_;
+  bool owned_;
+};
 
-enum class SectionType {
+enum class SectionType : uint8_t {
   None,
   Text,
   Data,
@@ -125,10 +183,32 @@ enum class SectionType {
   SymTable,
   StrTable,
   Rela,
-  ShStrTable
+  ShStrTable,
+  RoData,
+  Bss,
+  Got, // made by the linker, no input section has this type
+};
+
+inline constexpr size_t SECTION_TYPE_COUNT =
+    static_cast<size_t>(SectionType::Got) + 1;
+
+// A T for every SectionType, in a flat array indexed by the enum.
+template <typename T> struct BySectionType {
+  std::array<T, SECTION_TYPE_COUNT> items{};
+
+  T &operator[](SectionType t) { return items[static_cast<size_t>(t)]; }
+  const T &operator[](SectionType t) const {
+    return items[static_cast<size_t>(t)];
+  }
 };
 
-SectionType s_type_from_name(const std::string &n);
+SectionType s_type_from_name(std::string_view n);
+
+// Thrown when an input file can't be read or isn't an object told can link.
+// The message names the offending file.
+struct ParseError : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
 
 struct ElfHeader {
   unsigned char e_ident[EI_NIDENT]; /* Magic number and other info */
@@ -186,20 +266,82 @@ struct ElfRelocAddendEntry {
   Elf64_Sxword r_addend; /* Addend */
 };
 
+// A relocation against an input section, decoded from its ElfRelocAddendEntry.
+struct Relocation {
+  Elf64_Addr offset;     /* Offset into the relocated section */
+  Elf64_Word type;       /* R_X86_64_* */
+  Elf64_Word sym_index;  /* Index into symtab_entries */
+  Elf64_Sxword addend;   /* Addend */
+};
+
+// An allocated section of an object that goes into the output, e.g. .text
+// or, with -ffunction-sections, one of many .text.<function>.
+struct InputSection {
+  std::string_view name;
+  Elf64_Section shndx; /* Index in the object's section header table */
+  SectionType type;    /* Output section it belongs in */
+  BlockView data;      /* Empty for .bss, which has no bytes in the file */
+  Elf64_Xword size;
+  Elf64_Xword align;
+  // this section's entries in ElfBinary::relocations, [reloc_begin, reloc_end)
+  uint32_t reloc_begin;
+  uint32_t reloc_end;
+};
+
+inline constexpr uint32_t NO_INPUT_SECTION = UINT32_MAX;
+
 struct ElfBinary {
+  std::shared_ptr<const MappedFile> mapping;
+  // the object's bytes within `mapping`: the whole file, or one member of an
+  // archive.
+  BlockView contents;
   ElfHeader elf_header;
-  std::unordered_map<SectionType, ElfSectionHeader> section_headers;
-  std::unordered_map<SectionType, Block> sections;
-  std::unordered_map<Symbol, ElfSymbolTableEntry> symbol_table;
-  std::vector<ElfSymbolTableEntry> symtab_entries;
-  std::unordered_map<Symbol, ElfRelocAddendEntry> rela_entries;
+  // index of the first section of each type in the object's section header
+  // table, this is what symbols refer to in st_shndx. SHN_UNDEF if there's
+  // none.
+  BySectionType<Elf64_Section> section_indices;
+  // the full section header table, viewing `mapping`.
+  std::span<const ElfSectionHeader> section_header_table;
+  // contents views into `mapping`, nothing is copied out of the input file.
+  std::vector<InputSection> input_sections;
+  // position in input_sections of every section header index, or
+  // NO_INPUT_SECTION.
+  std::vector<uint32_t> input_section_index;
+  std::span<const ElfSymbolTableEntry> symtab_entries;
+  // names of symtab_entries, by index (empty for unnamed symbols).
+  std::vector<Symbol> symbol_names;
+  // symbol_hash of each name in symbol_names, 0 for local symbols which never
+  // go into the global symbol table.
+  std::vector<uint64_t> symbol_hashes;
+  // relocations of every input section, grouped by section (in input_sections
+  // order) and sorted by offset within each group.
+  std::vector<Relocation> relocations;
   std::string given_path;
 
   ElfBinary(const std::string &given_path) : given_path(given_path) {}
+
+  // The first section of type `t`, or nullptr if there's none.
+  const ElfSectionHeader *section_header(SectionType t) const {
+    Elf64_Section i = section_indices[t];
+    return i == SHN_UNDEF ? nullptr : &section_header_table[i];
+  }
+
+  // The input section `shndx` refers to, or nullptr if it isn't one.
+  const InputSection *input_section(Elf64_Section shndx) const {
+    if (shndx >= input_section_index.size() ||
+        input_section_index[shndx] == NO_INPUT_SECTION)
+      return nullptr;
+    return &input_sections[input_section_index[shndx]];
+  }
 };
 
 ElfBinary parse_object(const std::string &file_path);
 
+// Parses the object in `contents`, which lies within `mapping` (e.g. a member
+// of a mapped archive). `name` is what the module is called in diagnostics.
+ElfBinary parse_object_in(std::shared_ptr<const MappedFile> mapping,
+                          BlockView contents, const std::string &name);
+
 void assert_expected_elf_header(const ElfHeader &elf_header);
 
 }; // namespace elf
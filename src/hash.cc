@@ -0,0 +1,178 @@
+#include "hash.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+namespace told {
+
+namespace {
+
+constexpr uint64_t PRIME64_1 = 0x9e3779b185ebca87ULL;
+constexpr uint64_t PRIME64_2 = 0xc2b2ae3d27d4eb4fULL;
+constexpr uint64_t PRIME64_3 = 0x165667b19e3779f9ULL;
+constexpr uint64_t PRIME64_4 = 0x85ebca77c2b2ae63ULL;
+constexpr uint64_t PRIME64_5 = 0x27d4eb2f165667c5ULL;
+
+template <typename T> T read_le(const char *p) {
+  T v{};
+  std::memcpy(&v, p, sizeof(v));
+  return v; // x86-64 only, like the rest of told.
+}
+
+uint64_t xxh_round(uint64_t acc, uint64_t input) {
+  acc += input * PRIME64_2;
+  acc = std::rotl(acc, 31);
+  return acc * PRIME64_1;
+}
+
+uint64_t xxh_merge_round(uint64_t acc, uint64_t val) {
+  acc ^= xxh_round(0, val);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint32_t read_be32(const uint8_t *p) {
+  return uint32_t{p[0]} << 24 | uint32_t{p[1]} << 16 | uint32_t{p[2]} << 8 |
+         uint32_t{p[3]};
+}
+
+} // namespace
+
+uint64_t xxhash64(std::span<const char> data, uint64_t seed) {
+  const char *p = data.data();
+  const char *end = p + data.size();
+  uint64_t h{};
+  if (data.size() >= 32) {
+    uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+    uint64_t v2 = seed + PRIME64_2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - PRIME64_1;
+    for (; end - p >= 32; p += 32) {
+      v1 = xxh_round(v1, read_le<uint64_t>(p));
+      v2 = xxh_round(v2, read_le<uint64_t>(p + 8));
+      v3 = xxh_round(v3, read_le<uint64_t>(p + 16));
+      v4 = xxh_round(v4, read_le<uint64_t>(p + 24));
+    }
+    h = std::rotl(v1, 1) + std::rotl(v2, 7) + std::rotl(v3, 12) +
+        std::rotl(v4, 18);
+    h = xxh_merge_round(h, v1);
+    h = xxh_merge_round(h, v2);
+    h = xxh_merge_round(h, v3);
+    h = xxh_merge_round(h, v4);
+  } else {
+    h = seed + PRIME64_5;
+  }
+  h += data.size();
+
+  for (; end - p >= 8; p += 8) {
+    h ^= xxh_round(0, read_le<uint64_t>(p));
+    h = std::rotl(h, 27) * PRIME64_1 + PRIME64_4;
+  }
+  if (end - p >= 4) {
+    h ^= uint64_t{read_le<uint32_t>(p)} * PRIME64_1;
+    h = std::rotl(h, 23) * PRIME64_2 + PRIME64_3;
+    p += 4;
+  }
+  for (; p < end; ++p) {
+    h ^= uint64_t{static_cast<uint8_t>(*p)} * PRIME64_5;
+    h = std::rotl(h, 11) * PRIME64_1;
+  }
+
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+Sha1::Sha1()
+    : state_{0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0},
+      block_{}, block_size_(0), length_(0) {}
+
+void Sha1::compress(const uint8_t *block) {
+  uint32_t w[80];
+  for (size_t i = 0; i < 16; ++i)
+    w[i] = read_be32(block + 4 * i);
+  for (size_t i = 16; i < 80; ++i)
+    w[i] = std::rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+  uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3],
+           e = state_[4];
+  for (size_t i = 0; i < 80; ++i) {
+    uint32_t f{}, k{};
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5a827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ed9eba1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8f1bbcdc;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xca62c1d6;
+    }
+    uint32_t t = std::rotl(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = std::rotl(b, 30);
+    b = a;
+    a = t;
+  }
+  state_[0] += a;
+  state_[1] += b;
+  state_[2] += c;
+  state_[3] += d;
+  state_[4] += e;
+}
+
+void Sha1::update(std::span<const char> data) {
+  const auto *p = reinterpret_cast<const uint8_t *>(data.data());
+  size_t n = data.size();
+  length_ += n;
+  if (block_size_ > 0) {
+    size_t take = std::min(n, block_.size() - block_size_);
+    std::memcpy(block_.data() + block_size_, p, take);
+    block_size_ += take;
+    p += take;
+    n -= take;
+    if (block_size_ < block_.size())
+      return;
+    compress(block_.data());
+    block_size_ = 0;
+  }
+  for (; n >= block_.size(); p += block_.size(), n -= block_.size())
+    compress(p);
+  std::memcpy(block_.data(), p, n);
+  block_size_ = n;
+}
+
+Sha1::Digest Sha1::finish() {
+  const uint64_t bits = length_ * 8;
+  const char pad = '\x80';
+  update({&pad, 1});
+  const char zero = '\0';
+  while (block_size_ != 56)
+    update({&zero, 1});
+  char length[8];
+  for (size_t i = 0; i < 8; ++i)
+    length[i] = static_cast<char>(bits >> (56 - 8 * i));
+  update({length, sizeof(length)});
+
+  Digest digest{};
+  for (size_t i = 0; i < state_.size(); ++i) {
+    for (size_t j = 0; j < 4; ++j)
+      digest[4 * i + j] = static_cast<uint8_t>(state_[i] >> (24 - 8 * j));
+  }
+  return digest;
+}
+
+Sha1::Digest sha1(std::span<const char> data) {
+  Sha1 s{};
+  s.update(data);
+  return s.finish();
+}
+
+} // namespace told
@@ -0,0 +1,34 @@
+/// Content hashes for --build-id: xxHash64 when all that's needed is a
+/// unique-enough id, SHA-1 when tools expect a cryptographic one.
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace told {
+
+uint64_t xxhash64(std::span<const char> data, uint64_t seed = 0);
+
+class Sha1 {
+ public:
+  using Digest = std::array<uint8_t, 20>;
+
+  Sha1();
+  void update(std::span<const char> data);
+  // Pads the message and returns its digest. The object is spent afterwards.
+  Digest finish();
+
+ private:
+  void compress(const uint8_t *block);
+
+  std::array<uint32_t, 5> state_;
+  std::array<uint8_t, 64> block_;
+  size_t block_size_;
+  uint64_t length_;
+};
+
+Sha1::Digest sha1(std::span<const char> data);
+
+} // namespace told
@@ -0,0 +1,603 @@
+#include "incremental.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "alloc_profile.h"
+#include "elf_utils.h"
+#include "parallel.h"
+#include "relocation.h"
+#include "time_trace.h"
+#include "told.h"
+
+namespace told {
+
+static constexpr uint64_t STATE_MAGIC = 0x33636e692d646c74; // "tld-inc3"
+
+// A relocation against a global symbol, which has to be redone whenever the
+// module defining that symbol moves it.
+struct SavedReloc {
+  // from the start of the module's slot.
+  uint64_t offset;
+  uint32_t type;
+  int64_t addend;
+  std::string sym;
+};
+
+struct SavedModule {
+  std::string path;
+  uint64_t hash;
+  // the module's slot starts where the previous module's sections end, so
+  // laying its sections out again from here reproduces their alignment.
+  uint64_t text_offset;
+  uint64_t text_size;
+  // room the module has in the text segment, up to where the next one starts.
+  uint64_t slot_size;
+  std::vector<SavedReloc> relocs;
+};
+
+struct SavedSymbol {
+  std::string name;
+  uint32_t module;
+  uint32_t section;
+  uint32_t type;
+  uint64_t value;
+  uint64_t addr;
+};
+
+struct IncrementalState {
+  // link_option_args of the options the output was linked with. Any other
+  // options may lay it out differently, those links run in full.
+  std::vector<std::string> options;
+  uint64_t output_size;
+  int64_t output_mtime_ns;
+  uint64_t text_file_offset;
+  uint64_t text_addr;
+  std::vector<SavedModule> modules;
+  std::vector<SavedSymbol> symbols;
+};
+
+std::string incremental_state_path(const std::string &output_path) {
+  return output_path + ".told-state";
+}
+
+uint64_t content_hash(elf::BlockView bytes) {
+  return std::hash<std::string_view>{}(
+      std::string_view{bytes.data(), bytes.size()});
+}
+
+// Size and modification time identify the output we wrote last time, anything
+// else touching it makes patching it unsafe.
+std::optional<std::pair<uint64_t, int64_t>>
+output_identity(const std::string &path) {
+  struct stat st {};
+  if (stat(path.c_str(), &st) != 0)
+    return std::nullopt;
+  return std::make_pair(static_cast<uint64_t>(st.st_size),
+                        static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+                            st.st_mtim.tv_nsec);
+}
+
+struct StateWriter {
+  std::ofstream out;
+
+  template <typename T> void put(T v) {
+    out.write(reinterpret_cast<const char *>(&v), sizeof(v));
+  }
+  void put(std::string_view s) {
+    put<uint64_t>(s.size());
+    out.write(s.data(), static_cast<std::streamsize>(s.size()));
+  }
+};
+
+struct StateReader {
+  std::ifstream in;
+
+  template <typename T> T get() {
+    T v{};
+    in.read(reinterpret_cast<char *>(&v), sizeof(v));
+    return v;
+  }
+  std::string get_string() {
+    uint64_t n = get<uint64_t>();
+    // a corrupt length shouldn't turn into a huge allocation.
+    if (!in || n > (1u << 20)) {
+      in.setstate(std::ios::failbit);
+      return {};
+    }
+    std::string s(n, '\0');
+    in.read(s.data(), static_cast<std::streamsize>(n));
+    return s;
+  }
+};
+
+void write_state(const IncrementalState &st, const std::string &path) {
+  StateWriter w{std::ofstream{path, std::ios::binary | std::ios::trunc}};
+  w.put(STATE_MAGIC);
+  w.put<uint64_t>(st.options.size());
+  for (const auto &o : st.options)
+    w.put(std::string_view{o});
+  w.put(st.output_size);
+  w.put(st.output_mtime_ns);
+  w.put(st.text_file_offset);
+  w.put(st.text_addr);
+  w.put<uint64_t>(st.modules.size());
+  for (const auto &m : st.modules) {
+    w.put(std::string_view{m.path});
+    w.put(m.hash);
+    w.put(m.text_offset);
+    w.put(m.text_size);
+    w.put(m.slot_size);
+    w.put<uint64_t>(m.relocs.size());
+    for (const auto &r : m.relocs) {
+      w.put(r.offset);
+      w.put(r.type);
+      w.put(r.addend);
+      w.put(std::string_view{r.sym});
+    }
+  }
+  w.put<uint64_t>(st.symbols.size());
+  for (const auto &s : st.symbols) {
+    w.put(std::string_view{s.name});
+    w.put(s.module);
+    w.put(s.section);
+    w.put(s.type);
+    w.put(s.value);
+    w.put(s.addr);
+  }
+  if (!w.out) {
+    // not fatal, the next incremental link just won't find usable state.
+    std::cerr << "told: -- could not write incremental state to " << path
+              << "\n";
+  }
+}
+
+std::optional<IncrementalState> read_state(const std::string &path) {
+  StateReader r{std::ifstream{path, std::ios::binary}};
+  if (!r.in.is_open() || r.get<uint64_t>() != STATE_MAGIC)
+    return std::nullopt;
+  IncrementalState st{};
+  uint64_t n_options = r.get<uint64_t>();
+  for (uint64_t i = 0; i < n_options && r.in; ++i)
+    st.options.push_back(r.get_string());
+  st.output_size = r.get<uint64_t>();
+  st.output_mtime_ns = r.get<int64_t>();
+  st.text_file_offset = r.get<uint64_t>();
+  st.text_addr = r.get<uint64_t>();
+  uint64_t n_modules = r.get<uint64_t>();
+  for (uint64_t i = 0; i < n_modules && r.in; ++i) {
+    SavedModule m{};
+    m.path = r.get_string();
+    m.hash = r.get<uint64_t>();
+    m.text_offset = r.get<uint64_t>();
+    m.text_size = r.get<uint64_t>();
+    m.slot_size = r.get<uint64_t>();
+    uint64_t n_relocs = r.get<uint64_t>();
+    for (uint64_t j = 0; j < n_relocs && r.in; ++j) {
+      SavedReloc rel{};
+      rel.offset = r.get<uint64_t>();
+      rel.type = r.get<uint32_t>();
+      rel.addend = r.get<int64_t>();
+      rel.sym = r.get_string();
+      m.relocs.emplace_back(std::move(rel));
+    }
+    st.modules.emplace_back(std::move(m));
+  }
+  uint64_t n_symbols = r.get<uint64_t>();
+  for (uint64_t i = 0; i < n_symbols && r.in; ++i) {
+    SavedSymbol s{};
+    s.name = r.get_string();
+    s.module = r.get<uint32_t>();
+    s.section = r.get<uint32_t>();
+    s.type = r.get<uint32_t>();
+    s.value = r.get<uint64_t>();
+    s.addr = r.get<uint64_t>();
+    st.symbols.emplace_back(std::move(s));
+  }
+  if (!r.in)
+    return std::nullopt;
+  return st;
+}
+
+// Lays out the module's text sections one after the other from `start`, the
+// same way compute_output_offsets does. Returns their offsets and where the
+// last one ends.
+std::pair<std::vector<size_t>, size_t> layout_module(const elf::ElfBinary &mod,
+                                                     size_t start) {
+  std::vector<size_t> offsets(mod.input_sections.size(), NOT_PLACED);
+  size_t end = start;
+  for (size_t i = 0; i < mod.input_sections.size(); ++i) {
+    const elf::InputSection &sec = mod.input_sections[i];
+    if (sec.type != elf::SectionType::Text)
+      continue;
+    offsets[i] = (end + sec.align - 1) / sec.align * sec.align;
+    end = offsets[i] + sec.size;
+  }
+  return {std::move(offsets), end};
+}
+
+// Whether the module only has text to contribute, the only segment an
+// incremental relink knows how to patch. Compilers emit empty .data and .bss
+// even when there's nothing in them.
+bool text_only(const elf::ElfBinary &mod) {
+  return std::all_of(mod.input_sections.begin(), mod.input_sections.end(),
+                     [](const elf::InputSection &sec) {
+                       return sec.type == elf::SectionType::Text ||
+                              sec.size == 0;
+                     });
+}
+
+// Whether the module has GOT relocations. Those rewrite instructions or point
+// into the GOT, neither of which the saved relocations can redo.
+bool uses_got(const elf::ElfBinary &mod) {
+  return std::any_of(mod.relocations.begin(), mod.relocations.end(),
+                     [](const elf::Relocation &r) {
+                       return is_got_relocation(r.type);
+                     });
+}
+
+// Whether the module has weak symbols. Which definition of a weak symbol wins
+// depends on every other module, the saved symbols can't tell.
+bool has_weak_symbols(const elf::ElfBinary &mod) {
+  return std::any_of(mod.symtab_entries.begin(), mod.symtab_entries.end(),
+                     [](const elf::ElfSymbolTableEntry &ste) {
+                       return ELF64_ST_BIND(ste.st_info) == STB_WEAK;
+                     });
+}
+
+std::vector<SavedReloc> global_relocs(const elf::ElfBinary &mod,
+                                      const std::vector<size_t> &offsets,
+                                      size_t text_offset) {
+  std::vector<SavedReloc> relocs{};
+  for (size_t s = 0; s < mod.input_sections.size(); ++s) {
+    const elf::InputSection &sec = mod.input_sections[s];
+    for (size_t ri = sec.reloc_begin; ri < sec.reloc_end; ++ri) {
+      const elf::Relocation &r = mod.relocations[ri];
+      const elf::ElfSymbolTableEntry &ste = mod.symtab_entries[r.sym_index];
+      if (ELF64_ST_BIND(ste.st_info) == STB_LOCAL)
+        continue;
+      relocs.push_back(SavedReloc{offsets[s] - text_offset + r.offset, r.type,
+                                  r.addend,
+                                  std::string{mod.symbol_names[r.sym_index]}});
+    }
+  }
+  return relocs;
+}
+
+void save_incremental_state(const Executable &e) {
+  TimeTraceScope trace{"save_incremental_state"};
+  AllocPhase phase{"save_incremental_state"};
+  // a stale state file is harmless, the output it describes is gone.
+  for (const auto &mod : e.modules) {
+    if (!text_only(mod) || uses_got(mod) || has_weak_symbols(mod))
+      return;
+  }
+  const Segment &text_sg = e.segment(elf::SectionType::Text);
+  auto identity = output_identity(e.path);
+  if (!identity.has_value())
+    return;
+
+  IncrementalState st{};
+  st.options = link_option_args(e.options);
+  st.output_size = identity->first;
+  st.output_mtime_ns = identity->second;
+  st.text_file_offset = text_sg.file_offset;
+  st.text_addr = text_sg.start_addr;
+  st.modules.resize(e.modules.size());
+
+  // where each module's slot starts and its sections end.
+  std::vector<size_t> starts(e.modules.size() + 1);
+  std::vector<size_t> ends(e.modules.size());
+  for (size_t i = 0; i < e.modules.size(); ++i) {
+    const elf::ElfBinary &mod = e.modules[i];
+    const std::vector<size_t> &offsets = e.section_offsets[i];
+    ends[i] = starts[i];
+    for (size_t s = 0; s < offsets.size(); ++s) {
+      if (mod.input_sections[s].type == elf::SectionType::Text)
+        ends[i] = offsets[s] + mod.input_sections[s].size;
+    }
+    starts[i + 1] = ends[i];
+  }
+  starts.back() = text_sg.size;
+
+  parallel_for(e.modules.size(), [&](size_t i) {
+    const elf::ElfBinary &mod = e.modules[i];
+    st.modules[i] = SavedModule{
+        mod.given_path,
+        content_hash(mod.contents),
+        starts[i],
+        ends[i] - starts[i],
+        starts[i + 1] - starts[i],
+        global_relocs(mod, e.section_offsets[i], starts[i])};
+  });
+  e.g_symbol_table.for_each(
+      [&](const elf::Symbol &sym, const GlobalSymTableEntry &entry) {
+        st.symbols.push_back(SavedSymbol{
+            std::string{sym}, entry.module, entry.section,
+            static_cast<uint32_t>(entry.type), entry.value, entry.addr});
+      });
+  write_state(st, incremental_state_path(e.path));
+}
+
+// Global symbols a module defines, with their values. Returns nothing if one
+// of them isn't defined in an input section.
+std::optional<std::unordered_map<elf::Symbol, const elf::ElfSymbolTableEntry *>>
+defined_globals(const elf::ElfBinary &mod) {
+  std::unordered_map<elf::Symbol, const elf::ElfSymbolTableEntry *> defs{};
+  for (size_t s = 0; s < mod.symtab_entries.size(); ++s) {
+    const elf::ElfSymbolTableEntry &ste = mod.symtab_entries[s];
+    if (ELF64_ST_BIND(ste.st_info) != STB_GLOBAL || ste.st_shndx == SHN_UNDEF)
+      continue;
+    if (mod.input_section(ste.st_shndx) == nullptr)
+      return std::nullopt;
+    defs.emplace(mod.symbol_names[s], &ste);
+  }
+  return defs;
+}
+
+bool incremental_relink(const std::vector<std::string> &inputs,
+                        const std::string &output_path,
+                        const LinkOptions &options) {
+  TimeTraceScope trace{"incremental_relink"};
+  AllocPhase phase{"incremental_relink"};
+  std::optional<IncrementalState> loaded =
+      read_state(incremental_state_path(output_path));
+  if (!loaded.has_value())
+    return false;
+  IncrementalState &st = *loaded;
+  if (st.options != link_option_args(options))
+    return false;
+  auto identity = output_identity(output_path);
+  if (!identity.has_value() || identity->first != st.output_size ||
+      identity->second != st.output_mtime_ns ||
+      st.modules.size() != inputs.size())
+    return false;
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    if (st.modules[i].path != inputs[i])
+      return false;
+  }
+
+  // find what changed by content, not by timestamp.
+  std::vector<char> changed(inputs.size(), 0);
+  std::atomic<bool> unreadable{false};
+  parallel_for(inputs.size(), [&](size_t i) {
+    try {
+      auto mapping = elf::MappedFile::open(inputs[i]);
+      elf::BlockView bytes{mapping->data(), mapping->size()};
+      changed[i] = content_hash(bytes) != st.modules[i].hash;
+    } catch (const std::exception &) {
+      unreadable = true;
+    }
+  });
+  if (unreadable)
+    return false;
+  std::vector<std::string> changed_paths{};
+  std::vector<size_t> changed_idx{};
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    if (changed[i]) {
+      changed_paths.push_back(inputs[i]);
+      changed_idx.push_back(i);
+    }
+  }
+  if (changed_idx.empty()) {
+    std::cout << "told: -- " << output_path << " is up to date\n";
+    return true;
+  }
+
+  std::vector<elf::ElfBinary> parsed{};
+  try {
+    parsed = parse_objects(changed_paths);
+  } catch (const std::exception &) {
+    // let the full link report it.
+    return false;
+  }
+
+  std::unordered_map<std::string_view, size_t> symbol_index{};
+  for (size_t i = 0; i < st.symbols.size(); ++i)
+    symbol_index.emplace(st.symbols[i].name, i);
+
+  // A changed module has to fit where it was and define exactly the same
+  // global symbols; everything it references must still be defined.
+  std::vector<uint64_t> old_addrs(st.symbols.size());
+  for (size_t i = 0; i < st.symbols.size(); ++i)
+    old_addrs[i] = st.symbols[i].addr;
+  std::vector<std::vector<size_t>> changed_offsets(changed_idx.size());
+  for (size_t c = 0; c < changed_idx.size(); ++c) {
+    const elf::ElfBinary &mod = parsed[c];
+    SavedModule &saved = st.modules[changed_idx[c]];
+    if (!text_only(mod) || uses_got(mod) || has_weak_symbols(mod))
+      return false;
+    auto [offsets, end] = layout_module(mod, saved.text_offset);
+    if (end - saved.text_offset > saved.slot_size)
+      return false;
+
+    auto defs = defined_globals(mod);
+    if (!defs.has_value())
+      return false;
+    size_t previously_defined{};
+    for (auto &s : st.symbols) {
+      if (s.module != changed_idx[c])
+        continue;
+      ++previously_defined;
+      auto def = defs->find(s.name);
+      if (def == defs->end())
+        return false;
+      const elf::ElfSymbolTableEntry &ste = *def->second;
+      s.section = mod.input_section_index[ste.st_shndx];
+      if (offsets[s.section] == NOT_PLACED)
+        return false;
+      s.type = static_cast<uint32_t>(mod.input_sections[s.section].type);
+      s.value = ste.st_value;
+      s.addr = st.text_addr + offsets[s.section] + ste.st_value;
+    }
+    if (previously_defined != defs->size())
+      return false;
+    for (size_t s = 0; s < mod.symtab_entries.size(); ++s) {
+      const elf::ElfSymbolTableEntry &ste = mod.symtab_entries[s];
+      if (ELF64_ST_BIND(ste.st_info) != STB_GLOBAL || ste.st_shndx != SHN_UNDEF)
+        continue;
+      // anything it refers to has to exist and have an address.
+      auto it = symbol_index.find(mod.symbol_names[s]);
+      if (it == symbol_index.end() ||
+          st.symbols[it->second].section == elf::NO_INPUT_SECTION)
+        return false;
+    }
+    saved.hash = content_hash(mod.contents);
+    saved.text_size = end - saved.text_offset;
+    saved.relocs = global_relocs(mod, offsets, saved.text_offset);
+    changed_offsets[c] = std::move(offsets);
+  }
+
+  // only the changed modules go through the regular relocation path; the
+  // global symbol table is rebuilt from the saved (and updated) symbols.
+  // Their module numbers are input positions, not indices into e.modules,
+  // relocating only ever looks at the addresses.
+  Executable e{};
+  e.path = output_path;
+  e.segments[elf::SectionType::Text] = Segment{
+      st.text_addr, 0, 0, true, true, true, false, st.text_file_offset, 1};
+  for (const auto &s : st.symbols) {
+    e.g_symbol_table.define(
+        s.name,
+        GlobalSymTableEntry{s.module, s.section, s.value, s.addr,
+                            static_cast<elf::SectionType>(s.type), true, false,
+                            false});
+  }
+  e.modules = std::move(parsed);
+  for (size_t c = 0; c < changed_idx.size(); ++c) {
+    const elf::ElfBinary &mod = e.modules[c];
+    std::vector<SymbolId> ids(mod.symtab_entries.size(), NO_SYMBOL);
+    for (size_t s = 0; s < ids.size(); ++s) {
+      if (ELF64_ST_BIND(mod.symtab_entries[s].st_info) != STB_LOCAL)
+        ids[s] = e.g_symbol_table.id_of(mod.symbol_names[s],
+                                        mod.symbol_hashes[s]);
+    }
+    e.symbol_ids.push_back(std::move(ids));
+    // the empty non-text sections were left out of the layout.
+    std::vector<SectionFate> fates{};
+    for (size_t offset : changed_offsets[c])
+      fates.push_back(offset == NOT_PLACED ? SectionFate::Dropped
+                                           : SectionFate::Kept);
+    e.section_fates.push_back(std::move(fates));
+  }
+  e.section_offsets = std::move(changed_offsets);
+
+  // the changed modules are laid down and relocated in a private copy of the
+  // output first (only the pages they touch are copied). Only once all of
+  // them relocated cleanly do their slots go into the output itself, so that
+  // a failure leaves it untouched and the full link reports the error.
+  int fd = open(output_path.c_str(), O_RDWR);
+  if (fd < 0)
+    return false;
+  void *mapped = mmap(nullptr, st.output_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+  void *staged = mmap(nullptr, st.output_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE, fd, 0);
+  auto unmap = [&]() {
+    if (mapped != MAP_FAILED)
+      munmap(mapped, st.output_size);
+    if (staged != MAP_FAILED)
+      munmap(staged, st.output_size);
+    close(fd);
+  };
+  if (mapped == MAP_FAILED || staged == MAP_FAILED) {
+    unmap();
+    return false;
+  }
+  char *out = static_cast<char *>(mapped);
+  char *text_out = out + st.text_file_offset;
+  char *staged_out = static_cast<char *>(staged);
+  char *staged_text = staged_out + st.text_file_offset;
+
+  // unchanged modules only need the relocations against symbols that moved,
+  // check those up front too.
+  std::unordered_set<size_t> changed_set{changed_idx.begin(),
+                                         changed_idx.end()};
+  struct Patch {
+    size_t module;
+    const SavedReloc *reloc;
+    uint64_t sym_addr;
+  };
+  std::vector<Patch> patches{};
+  for (size_t i = 0; i < st.modules.size(); ++i) {
+    if (changed_set.contains(i))
+      continue;
+    for (const auto &r : st.modules[i].relocs) {
+      size_t s = symbol_index.at(r.sym);
+      if (st.symbols[s].addr != old_addrs[s])
+        patches.push_back(Patch{i, &r, st.symbols[s].addr});
+    }
+  }
+  for (const auto &p : patches) {
+    const SavedModule &m = st.modules[p.module];
+    char scratch[8];
+    if (apply_relocation(p.reloc->type, scratch, p.sym_addr, p.reloc->addend,
+                         st.text_addr + m.text_offset + p.reloc->offset) !=
+        RelocResult::Ok) {
+      unmap();
+      return false;
+    }
+  }
+
+  parallel_for(changed_idx.size(), [&](size_t c) {
+    const SavedModule &m = st.modules[changed_idx[c]];
+    const elf::ElfBinary &mod = e.modules[c];
+    const std::vector<size_t> &offsets = e.section_offsets[c];
+    // trap if anything ever jumps into the unused parts of the slot.
+    std::memset(staged_text + m.text_offset, '\xcc', m.slot_size);
+    for (size_t s = 0; s < offsets.size(); ++s) {
+      if (offsets[s] == NOT_PLACED)
+        continue;
+      elf::BlockView data = mod.input_sections[s].data;
+      std::memcpy(staged_text + offsets[s], data.data(), data.size());
+    }
+  });
+  if (!try_apply_relocations(e, staged_out)) {
+    unmap();
+    return false;
+  }
+  parallel_for(changed_idx.size(), [&](size_t c) {
+    const SavedModule &m = st.modules[changed_idx[c]];
+    std::memcpy(text_out + m.text_offset, staged_text + m.text_offset,
+                m.slot_size);
+  });
+  for (const auto &p : patches) {
+    const SavedModule &m = st.modules[p.module];
+    apply_relocation(p.reloc->type, text_out + m.text_offset + p.reloc->offset,
+                     p.sym_addr, p.reloc->addend,
+                     st.text_addr + m.text_offset + p.reloc->offset);
+  }
+  elf::Elf64_Addr entry = e.g_symbol_table.at(ENTRY_SYM).addr;
+  std::memcpy(out + offsetof(elf::ElfHeader, e_entry), &entry, sizeof(entry));
+  unmap();
+
+  identity = output_identity(output_path);
+  if (identity.has_value()) {
+    st.output_size = identity->first;
+    st.output_mtime_ns = identity->second;
+    write_state(st, incremental_state_path(output_path));
+  }
+  std::cout << "told: -- Incrementally relinked " << changed_idx.size()
+            << " of " << inputs.size() << " modules\n";
+  return true;
+}
+
+} // namespace told
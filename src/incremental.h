@@ -0,0 +1,32 @@
+/// Incremental relinking.
+///
+/// After a full link, save_incremental_state() records the layout next to the
+/// output: the link options it was made with, every module's content hash and
+/// place in the text segment, the resolved global symbols and the relocations
+/// that refer to them. The next incremental_relink() with the same options
+/// only re-parses the inputs whose contents changed and, if each still fits in
+/// its old slot, patches its bytes and every relocation affected by its
+/// symbols moving directly in the existing output.
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "told.h"
+
+namespace told {
+
+// Where the state for an incremental output lives.
+std::string incremental_state_path(const std::string &output_path);
+
+void save_incremental_state(const Executable &e);
+
+// Brings `output_path` up to date with `inputs` in place. Returns false when
+// that isn't possible (no or stale state, different inputs or link options, a
+// module that outgrew its slot or changed which symbols it defines, ...) and a
+// full link is needed instead.
+bool incremental_relink(const std::vector<std::string> &inputs,
+                        const std::string &output_path,
+                        const LinkOptions &options);
+
+} // namespace told
@@ -15,53 +15,265 @@
 /// foremost a learning project so using an LLM or other tool that takes out the
 /// actual coding part of the process would be antithetical to my own learning.
 
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <charconv>
+#include <exception>
 #include <filesystem>
 #include <iostream>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "alloc_profile.h"
+#include "archive.h"
+#include "incremental.h"
+#include "parallel.h"
+#include "server.h"
+#include "stats.h"
+#include "time_trace.h"
 #include "told.h"
 
 namespace fs = std::filesystem;
 
 void print_usage() {
   std::cerr << "told: usage --\n";
-  std::cerr << "  ./told FILE1 .. FILEN\n";
+  std::cerr << "  ./told [OPTION].. FILE1 .. FILEN\n";
+  std::cerr << "  ./told --server=SOCKET\n";
+  std::cerr << "options:\n";
+  std::cerr << "  --threads=N          use N threads for every phase (default:"
+               " all cores),\n"
+               "                       1 links serially\n";
+  std::cerr << "  --time-trace=FILE    write a Chrome trace of the link phases"
+               " to FILE\n";
+  std::cerr << "  --stats              print counts of the work the link did\n";
+  std::cerr << "  --fork               link in a child process and return as"
+               " soon as the\n"
+               "                       output is written\n";
+  std::cerr << "  --incremental        patch the previous output in place when"
+               " possible\n";
+  std::cerr << "  --server=SOCKET      serve links on SOCKET, keeping parsed"
+               " inputs cached\n";
+  std::cerr << "  --connect=SOCKET     have the server on SOCKET do the link\n";
+  std::cerr << "  --gc-sections        leave out sections nothing reachable"
+               " from _start uses\n";
+  std::cerr << "  --icf                fold identical functions into one"
+               " copy\n";
+  std::cerr << "  --symbol-ordering-file=FILE\n"
+               "                       place the functions listed in FILE"
+               " first\n";
+  std::cerr << "  --build-id[=fast|sha1|none]\n"
+               "                       write a .note.gnu.build-id hashed from"
+               " the output\n";
+  std::cerr << "  --hugepage-text      align executable segments to 2MB so"
+               " huge pages can\n"
+               "                       back them\n";
 }
 
-void chmod_executable(told::Executable &e) {
-  fs::path binary{e.path};
-  if (fs::exists(binary)) {
-    std::cout << "told: -- chmod-ing " << binary << "..." << std::endl;
-    fs::permissions(binary, fs::perms::all ^ fs::perms::others_write);
-    std::cout << "told: -- Done!" << std::endl;
+struct Options {
+  std::vector<std::string> inputs{};
+  std::string time_trace_path{};
+  bool stats = false;
+  bool fork = false;
+  bool incremental = false;
+  std::string server_socket{};
+  std::string connect_socket{};
+  told::LinkOptions link{};
+};
+
+// Parses the N of a `--flag=N` or `--flag N` option, bailing out on anything
+// that isn't a positive number.
+size_t parse_count_option(std::string_view value, std::string_view flag) {
+  size_t n{};
+  auto [ptr, ec] =
+      std::from_chars(value.data(), value.data() + value.size(), n);
+  if (ec != std::errc{} || ptr != value.data() + value.size() || n == 0) {
+    std::cerr << "told: -- invalid value for " << flag << " '" << value
+              << "'\n";
+    print_usage();
+    exit(1);
   }
+  return n;
 }
 
-// cd ../build && cmake -DCMAKE_BUILD_TYPE=Debug .. && cmake --build . &&
-// bin/told ../data/minimal.o && ./a.told
-int main(int argc, char *argv[]) {
-  if (argc == 1) {
+Options parse_args(int argc, char *argv[]) {
+  Options opts{};
+  opts.inputs.reserve(argc - 1);
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg{argv[i]};
+    if (arg.starts_with("--threads=")) {
+      told::set_thread_count(parse_count_option(arg.substr(10), "--threads"));
+    } else if (arg == "--threads" && i + 1 < argc) {
+      told::set_thread_count(parse_count_option(argv[++i], "--threads"));
+    } else if (arg.starts_with("--time-trace=")) {
+      opts.time_trace_path = arg.substr(13);
+    } else if (arg == "--stats") {
+      opts.stats = true;
+    } else if (arg == "--fork") {
+      opts.fork = true;
+    } else if (arg == "--incremental") {
+      opts.incremental = true;
+    } else if (arg.starts_with("--server=")) {
+      opts.server_socket = arg.substr(9);
+    } else if (arg.starts_with("--connect=")) {
+      opts.connect_socket = arg.substr(10);
+    } else if (told::parse_link_option(arg, opts.link)) {
+      continue;
+    } else if (arg.starts_with("--")) {
+      std::cerr << "told: -- unknown option " << arg << "\n";
+      print_usage();
+      exit(1);
+    } else {
+      opts.inputs.emplace_back(arg);
+    }
+  }
+  if (opts.inputs.empty() && opts.server_socket.empty()) {
     print_usage();
     exit(1);
   }
+  return opts;
+}
+
+// Flushes what was printed and leaves without running a single destructor.
+// Once the output is written, freeing the link state object by object (every
+// module, symbol table shard and mapping) only holds up whoever is waiting
+// on us; the kernel takes it all back at once.
+[[noreturn]] void fast_exit(int status) {
+  std::cout.flush();
+  std::cerr.flush();
+  _exit(status);
+}
+
+// --fork: splits off a child to do the link and returns in it, with the end
+// of a pipe to write to once the output is complete. The parent never
+// returns. It exits as soon as the child says it is done, so that even the
+// kernel tearing down the child's mappings happens after the build has
+// moved on. If the child exits without saying so, the parent exits with its
+// status. Returns -1, and links in this process, if there can't be a child.
+int fork_link() {
+  int done[2];
+  if (pipe(done) != 0)
+    return -1;
+  std::cout.flush();
+  std::cerr.flush();
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(done[0]);
+    close(done[1]);
+    return -1;
+  }
+  if (pid == 0) {
+    close(done[0]);
+    return done[1];
+  }
+  close(done[1]);
+  char c;
+  ssize_t n;
+  do {
+    n = read(done[0], &c, 1);
+  } while (n < 0 && errno == EINTR);
+  if (n == 1)
+    _exit(0);
+  int status{};
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+    ;
+  _exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+}
 
-  // Takes some filepaths that are supposed to be elf binaries and attempt to
-  // link them into an executable
-  std::cout << "told: -- Parsing input object files...\n";
+// Takes some filepaths that are supposed to be elf binaries or archives of
+// them and attempt to link them into an executable. Returns the link state,
+// unless the previous output was patched in place.
+std::optional<told::Executable>
+link_inputs(std::vector<std::string> &&inputs, bool incremental,
+            const told::LinkOptions &options) {
+  told::TimeTraceScope trace{"told"};
+  told::AllocPhase phase{"told"};
   std::vector<std::string> module_order{};
-  module_order.reserve(argc - 1);
-  std::unordered_map<std::string, elf::ElfBinary> modules{};
-  modules.reserve(argc - 1);
-  for (int i = 1; i < argc; i++) {
-    elf::ElfBinary module = told::parse_object(argv[i]);
-    // TODO: use the canonicalized path
-    modules.emplace(argv[i], std::move(module));
-    module_order.emplace_back(argv[i]);
+  std::vector<std::string> archive_paths{};
+  for (auto &in : inputs) {
+    if (elf::is_archive(in))
+      archive_paths.emplace_back(std::move(in));
+    else
+      module_order.emplace_back(std::move(in));
+  }
+  // the saved state only knows about whole object files laid out in input
+  // order, links that pull in archive members or move sections around always
+  // run in full. So do links with a build id, patching would make it stale.
+  incremental = incremental && archive_paths.empty() &&
+                options.default_layout() &&
+                options.build_id == told::BuildId::None;
+  if (incremental &&
+      told::incremental_relink(module_order, DEFAULT_OUTPUT_PATH, options)) {
+    return std::nullopt;
   }
 
-  std::cout << "told: -- Beginning linking process...\n";
-  told::Executable e = told::link(std::move(module_order), std::move(modules));
+  // archives are only searched once the objects are in, read their indexes
+  // first. The objects are parsed as part of the link, which resolves their
+  // symbols as they come in.
+  std::vector<elf::Archive> archives{};
+  try {
+    for (const auto &path : archive_paths)
+      archives.push_back(elf::parse_archive(path));
+  } catch (const std::exception &err) {
+    std::cerr << "told: -- error: " << err.what() << "\n";
+    exit(1);
+  }
+  std::cout << "told: -- Parsing input object files and linking...\n";
+  std::optional<told::Executable> linked{};
+  try {
+    linked.emplace(told::link(module_order, std::move(archives),
+                              DEFAULT_OUTPUT_PATH, options));
+  } catch (const std::exception &err) {
+    std::cerr << "told: -- error: " << err.what() << "\n";
+    exit(1);
+  }
+  told::Executable &e = *linked;
   told::write_out(e);
-  chmod_executable(e);
+  told::chmod_executable(e);
+  if (incremental)
+    told::save_incremental_state(e);
+  return linked;
+}
+
+// cd ../build && cmake -DCMAKE_BUILD_TYPE=Debug .. && cmake --build . &&
+// bin/told ../data/minimal.o && ./a.told
+int main(int argc, char *argv[]) {
+  Options opts = parse_args(argc, argv);
+  if (!opts.server_socket.empty())
+    return told::run_server(opts.server_socket);
+  if (!opts.connect_socket.empty()) {
+    return told::run_client(opts.connect_socket,
+                            told::link_option_args(opts.link), opts.inputs,
+                            DEFAULT_OUTPUT_PATH);
+  }
+  if (!opts.time_trace_path.empty())
+    told::time_trace_begin();
+  if (opts.stats)
+    told::stats_begin();
+  const int done_fd = opts.fork ? fork_link() : -1;
+
+  // kept alive to the end, see fast_exit.
+  std::optional<told::Executable> linked =
+      link_inputs(std::move(opts.inputs), opts.incremental, opts.link);
+  if (opts.stats)
+    told::print_stats(std::cout);
+  // only does anything in -DTOLD_ALLOC_PROFILE=ON builds.
+  told::print_alloc_profile(std::cerr);
+
+  if (!opts.time_trace_path.empty() &&
+      !told::write_time_trace(opts.time_trace_path)) {
+    std::cerr << "told: -- could not write time trace to "
+              << opts.time_trace_path << "\n";
+    fast_exit(1);
+  }
+  if (done_fd >= 0) {
+    std::cout.flush();
+    std::cerr.flush();
+    if (write(done_fd, "x", 1) != 1)
+      fast_exit(1);
+  }
+  fast_exit(0);
 }
@@ -0,0 +1,219 @@
+#include "parallel.h"
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace told {
+
+namespace {
+
+std::atomic<size_t> &thread_count_setting() {
+  static std::atomic<size_t> n{
+      std::max<size_t>(1, std::thread::hardware_concurrency())};
+  return n;
+}
+
+// Set on pool workers, and on the caller while it takes part in a
+// parallel_for, so that nested calls run serially instead of waiting on the
+// pool they are running on.
+thread_local bool in_parallel_for = false;
+
+// A thread's remaining share of the indices, [begin, end) packed into one
+// word: taking an index off the front and splitting off the back are then
+// both a single compare-and-swap.
+struct alignas(64) Share {
+  std::atomic<uint64_t> range{0};
+};
+
+uint64_t pack(uint32_t begin, uint32_t end) {
+  return uint64_t{begin} << 32 | end;
+}
+uint32_t range_begin(uint64_t range) {
+  return static_cast<uint32_t>(range >> 32);
+}
+uint32_t range_end(uint64_t range) { return static_cast<uint32_t>(range); }
+
+class ThreadPool {
+ public:
+  void run(size_t n, detail::IndexFn fn, const void *ctx) {
+    std::lock_guard<std::mutex> run_lock{run_mu_};
+    const size_t threads = thread_count();
+    if (workers_.size() + 1 != threads)
+      start(threads - 1);
+    // shares hold 32 bit indices.
+    for (size_t base = 0; base < n; base += UINT32_MAX) {
+      const auto count =
+          static_cast<uint32_t>(std::min<size_t>(n - base, UINT32_MAX));
+      for (size_t t = 0; t < threads; ++t) {
+        shares_[t].range.store(pack(static_cast<uint32_t>(count * t / threads),
+                                    static_cast<uint32_t>(count * (t + 1) /
+                                                          threads)));
+      }
+      {
+        std::lock_guard<std::mutex> lock{mu_};
+        fn_ = fn;
+        ctx_ = ctx;
+        base_ = base;
+        running_ = workers_.size();
+        ++generation_;
+      }
+      wake_.notify_all();
+      in_parallel_for = true;
+      work(0);
+      in_parallel_for = false;
+      std::unique_lock<std::mutex> lock{mu_};
+      done_.wait(lock, [&] { return running_ == 0; });
+    }
+  }
+
+ private:
+  void start(size_t workers) {
+    stop();
+    shares_ = std::make_unique<Share[]>(workers + 1);
+    workers_.reserve(workers);
+    for (size_t t = 0; t < workers; ++t)
+      workers_.emplace_back([this, t, seen = generation_] {
+        worker_main(t + 1, seen);
+      });
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock{mu_};
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    for (auto &w : workers_)
+      w.join();
+    workers_.clear();
+    stopping_ = false;
+  }
+
+  void worker_main(size_t self, uint64_t seen) {
+    in_parallel_for = true;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock{mu_};
+        wake_.wait(lock, [&] { return stopping_ || generation_ != seen; });
+        if (stopping_)
+          return;
+        seen = generation_;
+      }
+      work(self);
+      std::lock_guard<std::mutex> lock{mu_};
+      if (--running_ == 0)
+        done_.notify_one();
+    }
+  }
+
+  void work(size_t self) {
+    uint32_t i;
+    while (take(self, i))
+      fn_(ctx_, base_ + i);
+  }
+
+  // Takes the next index of `self`'s share, or failing that steals the back
+  // half of another thread's share, keeps its first index and makes the rest
+  // `self`'s share. False once every share is empty.
+  bool take(size_t self, uint32_t &i) {
+    std::atomic<uint64_t> &own = shares_[self].range;
+    uint64_t range = own.load();
+    while (range_begin(range) < range_end(range)) {
+      if (own.compare_exchange_weak(
+              range, pack(range_begin(range) + 1, range_end(range)))) {
+        i = range_begin(range);
+        return true;
+      }
+    }
+    const size_t threads = workers_.size() + 1;
+    for (size_t v = 1; v < threads; ++v) {
+      std::atomic<uint64_t> &victim = shares_[(self + v) % threads].range;
+      range = victim.load();
+      while (range_begin(range) < range_end(range)) {
+        const uint32_t begin = range_begin(range);
+        const uint32_t end = range_end(range);
+        const uint32_t mid = begin + (end - begin) / 2;
+        if (victim.compare_exchange_weak(range, pack(begin, mid))) {
+          i = mid;
+          own.store(pack(mid + 1, end));
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  // one parallel_for at a time, when it's called from several threads.
+  std::mutex run_mu_;
+  std::vector<std::thread> workers_;
+  // shares_[0] is the caller's, shares_[t] worker t's.
+  std::unique_ptr<Share[]> shares_;
+
+  std::mutex mu_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+  uint64_t generation_ = 0;
+  size_t running_ = 0;
+  bool stopping_ = false;
+  detail::IndexFn fn_ = nullptr;
+  const void *ctx_ = nullptr;
+  size_t base_ = 0;
+};
+
+// The process's pool, made on first use. Never destroyed: the workers are
+// left waiting when the process exits, so exiting doesn't join threads (which
+// a worker calling exit() couldn't do).
+//
+// A forked child only gets the thread that called fork(), none of the
+// workers, and the pool's locks may have been copied while one of them held
+// them. So the child forgets the parent's pool without touching it, and
+// makes its own if it runs a parallel_for.
+std::atomic<ThreadPool *> current_pool{nullptr};
+
+ThreadPool &pool() {
+  static const bool forget_on_fork = [] {
+    pthread_atfork(nullptr, nullptr, [] { current_pool.store(nullptr); });
+    return true;
+  }();
+  (void)forget_on_fork;
+  ThreadPool *p = current_pool.load();
+  if (p == nullptr) {
+    auto *fresh = new ThreadPool{};
+    if (current_pool.compare_exchange_strong(p, fresh))
+      p = fresh;
+    else
+      delete fresh;
+  }
+  return *p;
+}
+
+} // namespace
+
+size_t thread_count() { return thread_count_setting().load(); }
+
+void set_thread_count(size_t n) {
+  thread_count_setting().store(std::max<size_t>(1, n));
+}
+
+namespace detail {
+
+void run_parallel(size_t n, IndexFn fn, const void *ctx) {
+  if (in_parallel_for) {
+    for (size_t i = 0; i < n; ++i)
+      fn(ctx, i);
+    return;
+  }
+  pool().run(n, fn, ctx);
+}
+
+} // namespace detail
+
+} // namespace told
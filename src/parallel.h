@@ -0,0 +1,49 @@
+/// Fork/join helpers for spreading independent work over threads.
+///
+/// Every parallel phase runs on one process-wide pool of worker threads, which
+/// is started on first use and kept for the rest of the run.
+#pragma once
+
+#include <cstddef>
+#include <type_traits>
+
+namespace told {
+
+// Number of threads parallel_for is allowed to use, including the caller.
+// Defaults to the number of cores.
+size_t thread_count();
+
+// Takes effect from the next parallel_for on. 1 runs everything serially on
+// the calling thread.
+void set_thread_count(size_t n);
+
+namespace detail {
+using IndexFn = void (*)(const void *ctx, size_t i);
+void run_parallel(size_t n, IndexFn fn, const void *ctx);
+} // namespace detail
+
+// Calls f(i) for every i in [0, n) on up to thread_count() threads, the caller
+// being one of them. Returns once every call has finished. Each thread starts
+// on its own contiguous share of the indices and takes them one at a time;
+// one that runs out steals the back half of another's remaining share, so a
+// few slow items don't hold up the rest.
+//
+// A parallel_for inside another one runs serially on the thread that made the
+// call. f must not throw; callers that can fail should record the error per
+// index.
+template <typename F> void parallel_for(size_t n, F &&f) {
+  if (n <= 1 || thread_count() == 1) {
+    for (size_t i = 0; i < n; ++i)
+      f(i);
+    return;
+  }
+  using Fn = std::remove_reference_t<F>;
+  detail::run_parallel(
+      n,
+      [](const void *ctx, size_t i) {
+        (*static_cast<Fn *>(const_cast<void *>(ctx)))(i);
+      },
+      &f);
+}
+
+} // namespace told
@@ -0,0 +1,141 @@
+/// Handlers for the x86-64 relocation types told knows how to apply.
+///
+/// Each handler is specialized at compile time for its relocation type, so
+/// applying one is just the arithmetic and a store. The runtime dispatch on
+/// the type happens once per relocation in apply_relocation().
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+#include "elf_utils.h"
+
+namespace told {
+
+enum class RelocResult { Ok, Overflow, Unsupported };
+
+template <typename T> void write_le(char *loc, T value) {
+  std::memcpy(loc, &value, sizeof(value));
+}
+
+template <typename T> bool fits(int64_t value) {
+  return value >= static_cast<int64_t>(std::numeric_limits<T>::min()) &&
+         value <= static_cast<int64_t>(std::numeric_limits<T>::max());
+}
+
+// Patches the field at `loc` for a relocation of type `Type`, given the
+// symbol address S, the addend A and the address P of the field itself.
+template <elf::Elf64_Word Type>
+RelocResult apply_reloc(char *loc, uint64_t S, int64_t A, uint64_t P) {
+  if constexpr (Type == R_X86_64_64) {
+    write_le<uint64_t>(loc, S + static_cast<uint64_t>(A));
+    return RelocResult::Ok;
+  } else if constexpr (Type == R_X86_64_PC32 || Type == R_X86_64_PLT32) {
+    // statically linked, so a PLT32 call goes straight to the symbol.
+    int64_t value = static_cast<int64_t>(S + static_cast<uint64_t>(A) - P);
+    if (!fits<int32_t>(value))
+      return RelocResult::Overflow;
+    write_le<int32_t>(loc, static_cast<int32_t>(value));
+    return RelocResult::Ok;
+  } else if constexpr (Type == R_X86_64_32) {
+    int64_t value = static_cast<int64_t>(S + static_cast<uint64_t>(A));
+    if (!fits<uint32_t>(value))
+      return RelocResult::Overflow;
+    write_le<uint32_t>(loc, static_cast<uint32_t>(value));
+    return RelocResult::Ok;
+  } else if constexpr (Type == R_X86_64_32S) {
+    int64_t value = static_cast<int64_t>(S + static_cast<uint64_t>(A));
+    if (!fits<int32_t>(value))
+      return RelocResult::Overflow;
+    write_le<int32_t>(loc, static_cast<int32_t>(value));
+    return RelocResult::Ok;
+  } else {
+    return RelocResult::Unsupported;
+  }
+}
+
+inline RelocResult apply_relocation(elf::Elf64_Word type, char *loc, uint64_t S,
+                                    int64_t A, uint64_t P) {
+  switch (type) {
+  case R_X86_64_NONE:
+    return RelocResult::Ok;
+  case R_X86_64_64:
+    return apply_reloc<R_X86_64_64>(loc, S, A, P);
+  case R_X86_64_PC32:
+    return apply_reloc<R_X86_64_PC32>(loc, S, A, P);
+  case R_X86_64_PLT32:
+    return apply_reloc<R_X86_64_PLT32>(loc, S, A, P);
+  case R_X86_64_32:
+    return apply_reloc<R_X86_64_32>(loc, S, A, P);
+  case R_X86_64_32S:
+    return apply_reloc<R_X86_64_32S>(loc, S, A, P);
+  default:
+    return RelocResult::Unsupported;
+  }
+}
+
+// Number of bytes a relocation of the given type patches, 0 if unsupported.
+inline size_t reloc_width(elf::Elf64_Word type) {
+  switch (type) {
+  case R_X86_64_NONE:
+    return 0;
+  case R_X86_64_64:
+    return 8;
+  case R_X86_64_PC32:
+  case R_X86_64_PLT32:
+  case R_X86_64_32:
+  case R_X86_64_32S:
+  case R_X86_64_GOTPCREL:
+  case R_X86_64_GOTPCRELX:
+  case R_X86_64_REX_GOTPCRELX:
+    return 4;
+  default:
+    return 0;
+  }
+}
+
+// Relocations against the symbol's GOT slot (G + GOT + A - P). The linker
+// applies them itself, apply_relocation() doesn't know them.
+inline bool is_got_relocation(elf::Elf64_Word type) {
+  return type == R_X86_64_GOTPCREL || type == R_X86_64_GOTPCRELX ||
+         type == R_X86_64_REX_GOTPCRELX;
+}
+
+// Whether the instruction that a GOT relocation at `offset` in `code` is part
+// of can be rewritten to use the symbol directly, rather than load its
+// address from the GOT. Only the X variants promise that the opcode in front
+// of the field may be looked at. The forms that can are
+//
+//   mov foo@GOTPCREL(%rip), %reg    (REX or not) -> lea foo(%rip), %reg
+//   call *foo@GOTPCREL(%rip)                     -> addr32 call foo
+//   jmp *foo@GOTPCREL(%rip)                      -> nop; jmp foo
+inline bool can_relax_got_load(elf::Elf64_Word type, elf::BlockView code,
+                               size_t offset) {
+  if ((type != R_X86_64_GOTPCRELX && type != R_X86_64_REX_GOTPCRELX) ||
+      offset < 2)
+    return false;
+  const auto op = static_cast<uint8_t>(code[offset - 2]);
+  const auto modrm = static_cast<uint8_t>(code[offset - 1]);
+  if (op == 0x8b)
+    return (modrm & 0xc7) == 0x05; // rip-relative
+  return type == R_X86_64_GOTPCRELX && op == 0xff &&
+         (modrm == 0x15 || modrm == 0x25);
+}
+
+// Rewrites the instruction in front of `loc` the way can_relax_got_load()
+// allows. The field at `loc` stays where it is and becomes an R_X86_64_PC32
+// against the symbol.
+inline void relax_got_load(char *loc) {
+  if (static_cast<uint8_t>(loc[-2]) == 0x8b) {
+    loc[-2] = '\x8d'; // lea
+  } else if (static_cast<uint8_t>(loc[-1]) == 0x15) {
+    loc[-2] = '\x67'; // addr32 prefix, keeps the instruction's length
+    loc[-1] = '\xe8'; // call rel32
+  } else {
+    loc[-2] = '\x90'; // nop
+    loc[-1] = '\xe9'; // jmp rel32
+  }
+}
+
+} // namespace told
@@ -0,0 +1,379 @@
+#include "server.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "archive.h"
+#include "elf_utils.h"
+#include "time_trace.h"
+#include "told.h"
+
+namespace fs = std::filesystem;
+
+namespace told {
+
+// Messages on the socket are frames of [type][u32 length][payload].
+enum FrameType : char {
+  ARG = 'A',    // client -> server: output path, then one frame per link
+                // option and per input
+  RUN = 'R',    // client -> server: end of request
+  STDOUT = 'O', // server -> client
+  STDERR = 'E', // server -> client
+  STATUS = 'X', // server -> client: u32 exit status, last frame
+};
+
+bool send_all(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    // a client that went away mustn't SIGPIPE the server.
+    ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    data += n;
+    size -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+bool read_all(int fd, char *data, size_t size) {
+  while (size > 0) {
+    ssize_t n = read(fd, data, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    data += n;
+    size -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+bool send_frame(int fd, char type, std::string_view payload) {
+  char header[5];
+  header[0] = type;
+  auto len = static_cast<uint32_t>(payload.size());
+  std::memcpy(header + 1, &len, sizeof(len));
+  return send_all(fd, header, sizeof(header)) &&
+         send_all(fd, payload.data(), payload.size());
+}
+
+std::optional<std::pair<char, std::string>> recv_frame(int fd) {
+  char header[5];
+  if (!read_all(fd, header, sizeof(header)))
+    return std::nullopt;
+  uint32_t len{};
+  std::memcpy(&len, header + 1, sizeof(len));
+  if (len > (1u << 24))
+    return std::nullopt;
+  std::string payload(len, '\0');
+  if (!read_all(fd, payload.data(), len))
+    return std::nullopt;
+  return std::make_pair(header[0], std::move(payload));
+}
+
+bool send_status(int fd, uint32_t status) {
+  return send_frame(fd, STATUS,
+                    std::string_view{reinterpret_cast<char *>(&status),
+                                     sizeof(status)});
+}
+
+sockaddr_un socket_address(const std::string &path) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    std::cerr << "told: -- socket path is too long: " << path << "\n";
+    exit(1);
+  }
+  std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  return addr;
+}
+
+struct CachedModule {
+  int64_t mtime_ns;
+  int64_t size;
+  elf::ElfBinary module;
+};
+
+class LinkServer {
+ public:
+  // Serves one connection: reads its request, brings the cache up to date and
+  // runs the link.
+  void serve(int client) {
+    std::vector<std::string> args{};
+    for (;;) {
+      auto frame = recv_frame(client);
+      if (!frame.has_value())
+        return;
+      if (frame->first == RUN)
+        break;
+      if (frame->first == ARG)
+        args.emplace_back(std::move(frame->second));
+    }
+    if (args.size() < 2) {
+      send_frame(client, STDERR, "told: -- error: no input files\n");
+      send_status(client, 1);
+      return;
+    }
+    std::string output_path = std::move(args.front());
+    std::vector<std::string> inputs{};
+    std::vector<elf::Archive> archives{};
+    LinkOptions options{};
+
+    std::vector<std::string> canonical{};
+    try {
+      // archives are only mapped and have their index read, which is cheap
+      // enough to redo for every link; the members they end up contributing
+      // are parsed in the child.
+      for (auto it = args.begin() + 1; it != args.end(); ++it) {
+        // inputs are absolute paths, so they never look like an option.
+        if (it->starts_with("--")) {
+          if (!parse_link_option(*it, options))
+            throw std::runtime_error("unknown option " + *it);
+        } else if (elf::is_archive(*it)) {
+          archives.push_back(elf::parse_archive(*it));
+        } else {
+          inputs.emplace_back(std::move(*it));
+        }
+      }
+      canonical = refresh(inputs);
+    } catch (const std::exception &err) {
+      send_frame(client, STDERR,
+                 std::string{"told: -- error: "} + err.what() + "\n");
+      send_status(client, 1);
+      return;
+    }
+    send_status(client,
+                link_in_child(client, std::move(inputs), std::move(archives),
+                              canonical, std::move(output_path), options));
+  }
+
+ private:
+  // Re-parses every input whose cache entry is missing or stale and returns
+  // the canonical path (the cache key) of each input.
+  std::vector<std::string> refresh(const std::vector<std::string> &inputs) {
+    TimeTraceScope trace{"refresh_cache"};
+    std::vector<std::string> canonical{};
+    std::vector<std::string> stale{};
+    std::vector<std::pair<int64_t, int64_t>> stale_stats{};
+    for (const auto &in : inputs) {
+      struct stat st {};
+      if (stat(in.c_str(), &st) != 0)
+        throw elf::ParseError(in + ": input object file does not exist");
+      std::string key = fs::canonical(in).string();
+      int64_t mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+                      st.st_mtim.tv_nsec;
+      auto it = cache_.find(key);
+      if (it == cache_.end() || it->second.mtime_ns != mtime ||
+          it->second.size != st.st_size) {
+        stale.push_back(key);
+        stale_stats.emplace_back(mtime, st.st_size);
+      }
+      canonical.push_back(std::move(key));
+    }
+
+    std::vector<elf::ElfBinary> parsed = parse_objects(stale);
+    for (size_t i = 0; i < stale.size(); ++i) {
+      cache_.insert_or_assign(stale[i],
+                              CachedModule{stale_stats[i].first,
+                                           stale_stats[i].second,
+                                           std::move(parsed[i])});
+    }
+    std::cout << "told: -- server: parsed " << stale.size() << " of "
+              << inputs.size() << " inputs" << std::endl;
+    return canonical;
+  }
+
+  // Links in a child process, relaying its output to the client. Returns the
+  // child's exit status.
+  uint32_t link_in_child(int client, std::vector<std::string> &&inputs,
+                         std::vector<elf::Archive> &&archives,
+                         const std::vector<std::string> &canonical,
+                         std::string &&output_path,
+                         const LinkOptions &options) {
+    int out_pipe[2], err_pipe[2];
+    if (pipe(out_pipe) != 0)
+      return 1;
+    if (pipe(err_pipe) != 0) {
+      close(out_pipe[0]);
+      close(out_pipe[1]);
+      return 1;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+      close(out_pipe[0]);
+      close(out_pipe[1]);
+      close(err_pipe[0]);
+      close(err_pipe[1]);
+      return 1;
+    }
+    if (pid == 0) {
+      dup2(out_pipe[1], STDOUT_FILENO);
+      dup2(err_pipe[1], STDERR_FILENO);
+      close(out_pipe[0]);
+      close(out_pipe[1]);
+      close(err_pipe[0]);
+      close(err_pipe[1]);
+      close(client);
+      // the child has its own copy of the cache, so it can take the modules.
+      // An input listed more than once is copied until its last appearance,
+      // the link then reports its symbols as defined twice.
+      std::unordered_map<std::string_view, size_t> last_use{};
+      for (size_t i = 0; i < inputs.size(); ++i)
+        last_use[canonical[i]] = i;
+      std::vector<elf::ElfBinary> modules{};
+      modules.reserve(inputs.size());
+      for (size_t i = 0; i < inputs.size(); ++i) {
+        elf::ElfBinary &cached = cache_.at(canonical[i]).module;
+        if (last_use[canonical[i]] == i)
+          modules.push_back(std::move(cached));
+        else
+          modules.push_back(cached);
+        modules.back().given_path = inputs[i];
+      }
+      std::cout << "told: -- Beginning linking process...\n";
+      Executable e = link(std::move(modules), std::move(archives),
+                          std::move(output_path), options);
+      write_out(e);
+      chmod_executable(e);
+      std::cout.flush();
+      std::cerr.flush();
+      _exit(0);
+    }
+
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+    pollfd fds[2] = {{out_pipe[0], POLLIN, 0}, {err_pipe[0], POLLIN, 0}};
+    const char types[2] = {STDOUT, STDERR};
+    int open_fds = 2;
+    char buf[4096];
+    while (open_fds > 0) {
+      if (poll(fds, 2, -1) < 0) {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+      for (int i = 0; i < 2; ++i) {
+        if (fds[i].fd < 0 || fds[i].revents == 0)
+          continue;
+        ssize_t n = read(fds[i].fd, buf, sizeof(buf));
+        if (n > 0) {
+          send_frame(client, types[i],
+                     std::string_view{buf, static_cast<size_t>(n)});
+        } else if (n == 0 || errno != EINTR) {
+          close(fds[i].fd);
+          fds[i].fd = -1;
+          --open_fds;
+        }
+      }
+    }
+    // still open if poll failed.
+    for (const pollfd &fd : fds)
+      if (fd.fd >= 0)
+        close(fd.fd);
+    int status{};
+    waitpid(pid, &status, 0);
+    if (WIFEXITED(status))
+      return static_cast<uint32_t>(WEXITSTATUS(status));
+    return 128 + static_cast<uint32_t>(WTERMSIG(status));
+  }
+
+  std::unordered_map<std::string, CachedModule> cache_{};
+};
+
+int run_server(const std::string &socket_path) {
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) {
+    std::cerr << "told: -- could not create socket: " << std::strerror(errno)
+              << "\n";
+    return 1;
+  }
+  sockaddr_un addr = socket_address(socket_path);
+  // a socket left behind by a previous server.
+  unlink(socket_path.c_str());
+  if (bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+      listen(listener, 16) != 0) {
+    std::cerr << "told: -- could not listen on " << socket_path << ": "
+              << std::strerror(errno) << "\n";
+    return 1;
+  }
+  std::cout << "told: -- server listening on " << socket_path << std::endl;
+
+  LinkServer server{};
+  for (;;) {
+    int client = accept(listener, nullptr, nullptr);
+    if (client < 0) {
+      if (errno == EINTR)
+        continue;
+      std::cerr << "told: -- accept failed: " << std::strerror(errno) << "\n";
+      return 1;
+    }
+    server.serve(client);
+    close(client);
+  }
+}
+
+int run_client(const std::string &socket_path,
+               const std::vector<std::string> &link_args,
+               const std::vector<std::string> &inputs,
+               const std::string &output_path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un addr = socket_address(socket_path);
+  if (fd < 0 ||
+      connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+    std::cerr << "told: -- could not connect to server at " << socket_path
+              << ": " << std::strerror(errno) << "\n";
+    return 1;
+  }
+
+  // the server has its own working directory, send it absolute paths.
+  bool sent = send_frame(fd, ARG, fs::absolute(output_path).string());
+  for (const auto &arg : link_args)
+    sent = sent && send_frame(fd, ARG, arg);
+  for (const auto &in : inputs)
+    sent = sent && send_frame(fd, ARG, fs::absolute(in).string());
+  sent = sent && send_frame(fd, RUN, {});
+  if (!sent) {
+    std::cerr << "told: -- could not send request to server\n";
+    return 1;
+  }
+
+  for (;;) {
+    auto frame = recv_frame(fd);
+    if (!frame.has_value()) {
+      std::cerr << "told: -- lost connection to server\n";
+      return 1;
+    }
+    auto &[type, payload] = *frame;
+    if (type == STDOUT) {
+      std::cout << payload << std::flush;
+    } else if (type == STDERR) {
+      std::cerr << payload << std::flush;
+    } else if (type == STATUS && payload.size() == sizeof(uint32_t)) {
+      uint32_t status{};
+      std::memcpy(&status, payload.data(), sizeof(status));
+      close(fd);
+      return static_cast<int>(status);
+    }
+  }
+}
+
+} // namespace told
@@ -0,0 +1,31 @@
+/// Resident link server.
+///
+/// `told --server=SOCKET` listens on a Unix socket and keeps every object it
+/// has parsed in memory, keyed by canonical path, mtime and size. Clients
+/// (`told --connect=SOCKET FILE1 .. FILEN`) send it a link request; only the
+/// inputs that changed since they were cached are parsed again before the
+/// link runs against the cached modules.
+///
+/// Each link runs in a forked child so that a failing link (which exits) can't
+/// take the server and its cache down with it. The child's stdout and stderr
+/// are relayed back to the client, followed by its exit status.
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace told {
+
+// Serves link requests until killed. Returns non-zero if the socket couldn't
+// be set up.
+int run_server(const std::string &socket_path);
+
+// Sends a link of `inputs` into `output_path` to the server and returns the
+// link's exit status. `link_args` are link options (see parse_link_option)
+// for the server to apply.
+int run_client(const std::string &socket_path,
+               const std::vector<std::string> &link_args,
+               const std::vector<std::string> &inputs,
+               const std::string &output_path);
+
+} // namespace told
@@ -0,0 +1,150 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "elf_utils.h"
+
+namespace told {
+
+struct StatsState {
+  std::atomic<bool> enabled{false};
+  std::array<std::atomic<uint64_t>, STAT_COUNT> counters{};
+  std::array<std::atomic<uint64_t>, STAT_RELOC_TYPES> relocations{};
+  std::mutex mu{};
+  std::vector<std::pair<std::string, uint64_t>> inputs{};
+};
+
+StatsState &stats_state() {
+  static StatsState state{};
+  return state;
+}
+
+void stats_begin() {
+  stats_state().enabled.store(true, std::memory_order_release);
+}
+
+bool stats_enabled() {
+  return stats_state().enabled.load(std::memory_order_relaxed);
+}
+
+void add_stat(Stat stat, uint64_t n) {
+  if (!stats_enabled())
+    return;
+  stats_state().counters[static_cast<size_t>(stat)].fetch_add(
+      n, std::memory_order_relaxed);
+}
+
+void add_input_stat(std::string_view path, uint64_t bytes) {
+  if (!stats_enabled())
+    return;
+  add_stat(Stat::InputFiles, 1);
+  add_stat(Stat::InputBytes, bytes);
+  StatsState &state = stats_state();
+  std::lock_guard<std::mutex> lock{state.mu};
+  state.inputs.emplace_back(path, bytes);
+}
+
+void add_relocation_stat(uint32_t type, uint64_t n) {
+  if (!stats_enabled() || n == 0)
+    return;
+  stats_state()
+      .relocations[std::min(type, STAT_RELOC_TYPES - 1)]
+      .fetch_add(n, std::memory_order_relaxed);
+}
+
+const char *stat_name(Stat stat) {
+  switch (stat) {
+  case Stat::InputFiles:
+    return "input files mapped";
+  case Stat::InputBytes:
+    return "input bytes mapped";
+  case Stat::InputSyscalls:
+    return "input file syscalls";
+  case Stat::SymbolsParsed:
+    return "symbols parsed";
+  case Stat::GlobalSymbols:
+    return "global symbols resolved";
+  case Stat::UndefinedSymbols:
+    return "symbols left undefined";
+  case Stat::RelaxedGotLoads:
+    return "GOT loads relaxed";
+  case Stat::SectionBytesCopied:
+    return "section bytes copied";
+  case Stat::PaddingBytes:
+    return "padding bytes";
+  case Stat::OutputBytes:
+    return "output bytes";
+  }
+  return "?";
+}
+
+std::string relocation_name(uint32_t type) {
+  switch (type) {
+  case R_X86_64_64:
+    return "R_X86_64_64";
+  case R_X86_64_PC32:
+    return "R_X86_64_PC32";
+  case R_X86_64_PLT32:
+    return "R_X86_64_PLT32";
+  case R_X86_64_GOTPCREL:
+    return "R_X86_64_GOTPCREL";
+  case R_X86_64_32:
+    return "R_X86_64_32";
+  case R_X86_64_32S:
+    return "R_X86_64_32S";
+  case R_X86_64_GOTPCRELX:
+    return "R_X86_64_GOTPCRELX";
+  case R_X86_64_REX_GOTPCRELX:
+    return "R_X86_64_REX_GOTPCRELX";
+  }
+  if (type == STAT_RELOC_TYPES - 1)
+    return "type " + std::to_string(type) + "+";
+  return "type " + std::to_string(type);
+}
+
+void print_stats(std::ostream &out) {
+  StatsState &state = stats_state();
+  char line[128];
+  auto row = [&](int indent, const std::string &name, uint64_t n) {
+    std::snprintf(line, sizeof(line), "%*s%-*s %14" PRIu64 "\n", indent, "",
+                  34 - indent, name.c_str(), n);
+    out << line;
+  };
+
+  out << "told: -- stats:\n";
+  for (size_t s = 0; s < STAT_COUNT; ++s)
+    row(2, stat_name(static_cast<Stat>(s)), state.counters[s].load());
+
+  uint64_t relocations{};
+  for (const auto &n : state.relocations)
+    relocations += n.load();
+  row(2, "relocations applied", relocations);
+  for (uint32_t t = 0; t < STAT_RELOC_TYPES; ++t) {
+    if (uint64_t n = state.relocations[t].load(); n != 0)
+      row(4, relocation_name(t), n);
+  }
+
+  // all of them would drown out the rest on a big link.
+  std::lock_guard<std::mutex> lock{state.mu};
+  std::vector<std::pair<std::string, uint64_t>> inputs = state.inputs;
+  const size_t shown = std::min<size_t>(inputs.size(), 10);
+  std::partial_sort(inputs.begin(), inputs.begin() + shown, inputs.end(),
+                    [](const auto &a, const auto &b) {
+                      return a.second != b.second ? a.second > b.second
+                                                  : a.first < b.first;
+                    });
+  if (shown != 0)
+    out << "  largest inputs (bytes mapped):\n";
+  for (size_t i = 0; i < shown; ++i)
+    row(4, inputs[i].first, inputs[i].second);
+}
+
+} // namespace told
@@ -0,0 +1,50 @@
+/// --stats: counts of the work a link did, from the input bytes mapped to the
+/// relocations applied and the bytes written, printed once it is done.
+///
+/// Counting is off unless stats_begin() was called. Until then adding to a
+/// counter only checks a flag. Counters are added to once per file, module or
+/// section, never once per symbol or byte, so they stay cheap when on too.
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string_view>
+
+namespace told {
+
+enum class Stat : uint8_t {
+  InputFiles,
+  InputBytes,
+  // open, fstat, mmap, read, munmap and close on input files. Path lookups
+  // done through std::filesystem aren't counted.
+  InputSyscalls,
+  SymbolsParsed,
+  GlobalSymbols,
+  UndefinedSymbols,
+  RelaxedGotLoads,
+  // input section bytes copied into the output.
+  SectionBytesCopied,
+  // bytes of the output nothing was written to: alignment gaps and page
+  // padding, left as the zeros the file was created with.
+  PaddingBytes,
+  OutputBytes,
+};
+
+inline constexpr size_t STAT_COUNT =
+    static_cast<size_t>(Stat::OutputBytes) + 1;
+
+// Relocation types at or past this are counted together.
+inline constexpr uint32_t STAT_RELOC_TYPES = 64;
+
+void stats_begin();
+bool stats_enabled();
+
+void add_stat(Stat stat, uint64_t n);
+// Records that `bytes` of the file at `path` were mapped.
+void add_input_stat(std::string_view path, uint64_t bytes);
+void add_relocation_stat(uint32_t type, uint64_t n);
+
+// Writes every counter, the relocations by type and the largest inputs.
+void print_stats(std::ostream &out);
+
+} // namespace told
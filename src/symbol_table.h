@@ -0,0 +1,259 @@
+/// Global symbol table shared by all input modules during resolution.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "elf_utils.h"
+#include "parallel.h"
+
+namespace told {
+
+// Module index of a symbol that has only been referenced so far, or that the
+// linker defines itself.
+inline constexpr uint32_t NO_MODULE = UINT32_MAX;
+
+struct GlobalSymTableEntry {
+  // index of the defining module in Executable::modules, NO_MODULE for
+  // symbols the linker defines (relative to their segment).
+  uint32_t module;
+  // index of the defining module's input section the symbol is in, or
+  // elf::NO_INPUT_SECTION if it isn't in one (then type is None too).
+  uint32_t section;
+  elf::Elf64_Addr value;
+  elf::Elf64_Addr addr;
+  elf::SectionType type;
+  // false while the symbol has only been referenced.
+  bool defined;
+  // defined by a weak symbol, which gives way to any other definition.
+  bool weak;
+  // some module refers to it without a weak reference. Only those have to
+  // be defined, a symbol that is only referenced weakly resolves to 0.
+  bool strong_ref;
+};
+
+// Identifies a symbol's entry in the SymbolTable. Ids are handed out as
+// symbols are inserted and never change, so they can be kept instead of the
+// name for lookups once resolution is done.
+using SymbolId = uint32_t;
+inline constexpr SymbolId NO_SYMBOL = UINT32_MAX;
+
+// Open-addressing hash table split into independently locked shards so that
+// modules can publish their definitions and references concurrently. A
+// symbol always lives in the shard picked by the high bits of its hash, so
+// two threads only contend when they touch symbols in the same shard.
+//
+// Within a shard, slots hold the full hash next to the entry's index, and
+// names and entries are kept in separate flat arrays (passes over the
+// entries never pull names into cache). Probing only compares names
+// whose hashes match, and growing the table never rehashes a name. Symbol
+// hashes are the ones precomputed by the parser (elf::symbol_hash).
+class SymbolTable {
+ public:
+  static constexpr size_t SHARD_BITS = 6;
+  static constexpr size_t SHARD_COUNT = size_t{1} << SHARD_BITS;
+
+  struct Defined {
+    SymbolId id;
+    // module holding the existing definition if `sym` was already defined.
+    std::optional<uint32_t> prev_def;
+  };
+
+  SymbolTable() : shards_(SHARD_COUNT) {}
+  SymbolTable(const SymbolTable &) = delete;
+  SymbolTable &operator=(const SymbolTable &) = delete;
+  SymbolTable(SymbolTable &&) = default;
+  SymbolTable &operator=(SymbolTable &&) = default;
+
+  // Makes room for about `n` more symbols up front, so that publishing them
+  // doesn't grow the shards over and over.
+  void reserve(size_t n) {
+    parallel_for(shards_.size(), [&](size_t i) {
+      Shard &s = shards_[i];
+      s.reserve(s.entries.size() + n / SHARD_COUNT + 1);
+    });
+  }
+
+  // Records the definition of `sym`. A strong definition replaces a weak one,
+  // of two weak ones the one in the earlier module is kept, so that the
+  // outcome doesn't depend on the order modules publish in. If both are
+  // strong, nothing is changed and prev_def names the module holding the
+  // existing definition.
+  Defined define(const elf::Symbol &sym, uint64_t hash,
+                 GlobalSymTableEntry entry) {
+    Shard &s = shard_for(hash);
+    std::lock_guard<std::mutex> lock{s.mu};
+    auto [index, inserted] = s.insert(sym, hash, entry);
+    GlobalSymTableEntry &existing = s.entries[index];
+    if (inserted)
+      return {make_id(hash, index), std::nullopt};
+    if (existing.defined && !existing.weak && !entry.weak)
+      return {make_id(hash, index), existing.module};
+    if (!existing.defined || (existing.weak && !entry.weak) ||
+        (existing.weak && entry.module < existing.module)) {
+      entry.strong_ref = entry.strong_ref || existing.strong_ref;
+      existing = entry;
+    }
+    return {make_id(hash, index), std::nullopt};
+  }
+
+  Defined define(const elf::Symbol &sym, GlobalSymTableEntry entry) {
+    return define(sym, elf::symbol_hash(sym), entry);
+  }
+
+  // Records that `sym` is used, `weak`ly or not. Leaves an undefined
+  // placeholder behind if no module has defined it (yet).
+  SymbolId reference(const elf::Symbol &sym, uint64_t hash, bool weak) {
+    Shard &s = shard_for(hash);
+    std::lock_guard<std::mutex> lock{s.mu};
+    auto [index, inserted] =
+        s.insert(sym, hash,
+                 GlobalSymTableEntry{NO_MODULE, elf::NO_INPUT_SECTION, 0, 0,
+                                     {}, false, false, !weak});
+    if (!weak)
+      s.entries[index].strong_ref = true;
+    return make_id(hash, index);
+  }
+
+  // Lookups are not synchronized; they're meant for after resolution is done.
+  SymbolId id_of(const elf::Symbol &sym, uint64_t hash) const {
+    const Shard &s = shards_[shard_index(hash)];
+    std::optional<uint32_t> index = s.find(sym, hash);
+    return index.has_value() ? make_id(hash, *index) : NO_SYMBOL;
+  }
+
+  const GlobalSymTableEntry &entry(SymbolId id) const {
+    return shards_[id & (SHARD_COUNT - 1)].entries[id >> SHARD_BITS];
+  }
+
+  const GlobalSymTableEntry *find(const elf::Symbol &sym) const {
+    SymbolId id = id_of(sym, elf::symbol_hash(sym));
+    return id == NO_SYMBOL ? nullptr : &entry(id);
+  }
+
+  const GlobalSymTableEntry &at(const elf::Symbol &sym) const {
+    const GlobalSymTableEntry *entry = find(sym);
+    if (entry == nullptr)
+      throw std::out_of_range("symbol not in global symbol table");
+    return *entry;
+  }
+
+  size_t size() const {
+    size_t n{};
+    for (const auto &s : shards_)
+      n += s.entries.size();
+    return n;
+  }
+
+  // Calls f(symbol, entry) for every entry, one shard at a time.
+  template <typename F> void for_each(F &&f) const {
+    for (const auto &s : shards_)
+      for (size_t i = 0; i < s.entries.size(); ++i)
+        f(s.names[i], s.entries[i]);
+  }
+
+  // Calls f(symbol, entry) for every entry, with shards spread over threads.
+  // f may modify the entry it is given.
+  template <typename F> void parallel_for_each(F &&f) {
+    parallel_for(shards_.size(), [&](size_t i) {
+      Shard &s = shards_[i];
+      for (size_t j = 0; j < s.entries.size(); ++j)
+        f(s.names[j], s.entries[j]);
+    });
+  }
+
+ private:
+  static constexpr uint32_t EMPTY_SLOT = UINT32_MAX;
+
+  struct Slot {
+    uint64_t hash;
+    uint32_t index; // into the shard's names and entries, or EMPTY_SLOT
+  };
+
+  struct Shard {
+    std::mutex mu;
+    // power of two long, kept at most 3/4 full.
+    std::vector<Slot> slots;
+    std::vector<elf::Symbol> names;
+    std::vector<GlobalSymTableEntry> entries;
+
+    std::optional<uint32_t> find(const elf::Symbol &sym, uint64_t hash) const {
+      if (slots.empty())
+        return std::nullopt;
+      const size_t mask = slots.size() - 1;
+      for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        const Slot &slot = slots[i];
+        if (slot.index == EMPTY_SLOT)
+          return std::nullopt;
+        if (slot.hash == hash && names[slot.index] == sym)
+          return slot.index;
+      }
+    }
+
+    // Returns the index of `sym`'s entry and whether it was just added (with
+    // `entry`).
+    std::pair<uint32_t, bool> insert(const elf::Symbol &sym, uint64_t hash,
+                                     const GlobalSymTableEntry &entry) {
+      if ((entries.size() + 1) * 4 > slots.size() * 3)
+        grow(slots.empty() ? 16 : slots.size() * 2);
+      const size_t mask = slots.size() - 1;
+      size_t i = hash & mask;
+      for (; slots[i].index != EMPTY_SLOT; i = (i + 1) & mask) {
+        if (slots[i].hash == hash && names[slots[i].index] == sym)
+          return {slots[i].index, false};
+      }
+      const auto index = static_cast<uint32_t>(entries.size());
+      slots[i] = Slot{hash, index};
+      names.push_back(sym);
+      entries.push_back(entry);
+      return {index, true};
+    }
+
+    void reserve(size_t n) {
+      size_t capacity = slots.empty() ? 16 : slots.size();
+      while (n * 4 > capacity * 3)
+        capacity *= 2;
+      if (capacity != slots.size())
+        grow(capacity);
+      names.reserve(n);
+      entries.reserve(n);
+    }
+
+    // Moves every slot into a table of `capacity` slots, by its stored hash.
+    void grow(size_t capacity) {
+      std::vector<Slot> old = std::move(slots);
+      slots.assign(capacity, Slot{0, EMPTY_SLOT});
+      const size_t mask = capacity - 1;
+      for (const Slot &slot : old) {
+        if (slot.index == EMPTY_SLOT)
+          continue;
+        size_t i = slot.hash & mask;
+        while (slots[i].index != EMPTY_SLOT)
+          i = (i + 1) & mask;
+        slots[i] = slot;
+      }
+    }
+  };
+
+  static size_t shard_index(uint64_t hash) {
+    // use the high bits, the slots inside each shard are picked by the low
+    // ones.
+    return static_cast<size_t>(hash >> (64 - SHARD_BITS));
+  }
+
+  static SymbolId make_id(uint64_t hash, uint32_t index) {
+    return static_cast<SymbolId>(index << SHARD_BITS | shard_index(hash));
+  }
+
+  Shard &shard_for(uint64_t hash) { return shards_[shard_index(hash)]; }
+
+  std::vector<Shard> shards_;
+};
+
+} // namespace told
@@ -0,0 +1,131 @@
+#include "time_trace.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace told {
+
+struct TraceEvent {
+  std::string name;
+  std::string detail;
+  uint32_t tid;
+  int64_t start_us;
+  int64_t dur_us;
+};
+
+struct TraceState {
+  std::atomic<bool> enabled{false};
+  std::chrono::steady_clock::time_point begin{};
+  std::mutex mu{};
+  std::vector<TraceEvent> events{};
+  std::atomic<uint32_t> next_tid{0};
+};
+
+TraceState &trace_state() {
+  static TraceState state{};
+  return state;
+}
+
+// Small, stable ids read better in the viewer than std::thread::id hashes.
+uint32_t trace_tid() {
+  thread_local uint32_t tid = trace_state().next_tid.fetch_add(1);
+  return tid;
+}
+
+int64_t micros_since_begin(std::chrono::steady_clock::time_point t) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             t - trace_state().begin)
+      .count();
+}
+
+void time_trace_begin() {
+  TraceState &state = trace_state();
+  state.begin = std::chrono::steady_clock::now();
+  // the thread turning tracing on (main) gets tid 0.
+  trace_tid();
+  state.enabled.store(true, std::memory_order_release);
+}
+
+bool time_trace_enabled() {
+  return trace_state().enabled.load(std::memory_order_relaxed);
+}
+
+TimeTraceScope::TimeTraceScope(std::string_view name, std::string_view detail)
+    : name_(name), detail_(detail), active_(time_trace_enabled()) {
+  if (active_)
+    start_ = std::chrono::steady_clock::now();
+}
+
+TimeTraceScope::~TimeTraceScope() {
+  if (!active_)
+    return;
+  auto end = std::chrono::steady_clock::now();
+  TraceEvent ev{std::string{name_}, std::string{detail_}, trace_tid(),
+                micros_since_begin(start_), 0};
+  ev.dur_us = micros_since_begin(end) - ev.start_us;
+  TraceState &state = trace_state();
+  std::lock_guard<std::mutex> lock{state.mu};
+  state.events.emplace_back(std::move(ev));
+}
+
+void write_json_string(std::ostream &out, std::string_view s) {
+  out << '"';
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char buf[8];
+      std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out << buf;
+    } else {
+      out << c;
+    }
+  }
+  out << '"';
+}
+
+bool write_time_trace(const std::string &path) {
+  TraceState &state = trace_state();
+  std::ofstream out{path, std::ios::trunc};
+  if (!out.is_open())
+    return false;
+
+  std::lock_guard<std::mutex> lock{state.mu};
+  out << "{\"traceEvents\":[\n";
+  bool first = true;
+  for (const auto &ev : state.events) {
+    if (!first)
+      out << ",\n";
+    first = false;
+    out << "{\"ph\":\"X\",\"pid\":1,\"tid\":" << ev.tid
+        << ",\"ts\":" << ev.start_us << ",\"dur\":" << ev.dur_us
+        << ",\"name\":";
+    write_json_string(out, ev.name);
+    if (!ev.detail.empty()) {
+      out << ",\"args\":{\"detail\":";
+      write_json_string(out, ev.detail);
+      out << "}";
+    }
+    out << "}";
+  }
+  // name the threads so the viewer doesn't just show numbers.
+  for (uint32_t tid = 0; tid < state.next_tid.load(); ++tid) {
+    if (!first)
+      out << ",\n";
+    first = false;
+    out << "{\"ph\":\"M\",\"pid\":1,\"tid\":" << tid
+        << ",\"name\":\"thread_name\",\"args\":{\"name\":\""
+        << (tid == 0 ? "told" : "told worker") << "\"}}";
+  }
+  out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+  return static_cast<bool>(out);
+}
+
+} // namespace told
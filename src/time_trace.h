@@ -0,0 +1,40 @@
+/// --time-trace: scoped phase timers written out as Chrome trace JSON, which
+/// loads in chrome://tracing and Perfetto.
+///
+/// Tracing is off unless time_trace_begin() was called. Until then a
+/// TimeTraceScope only checks a flag, so scopes can stay in hot paths.
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <string_view>
+
+namespace told {
+
+void time_trace_begin();
+bool time_trace_enabled();
+
+// Writes every recorded scope to `path`. Returns false if it couldn't be
+// written.
+bool write_time_trace(const std::string &path);
+
+// Records the time between its construction and destruction as one trace
+// event on the current thread. Scopes nest, so a phase scope with per-module
+// scopes inside it shows up as a stack. `name` and `detail` must outlive the
+// scope.
+class TimeTraceScope {
+ public:
+  explicit TimeTraceScope(std::string_view name, std::string_view detail = {});
+  ~TimeTraceScope();
+
+  TimeTraceScope(const TimeTraceScope &) = delete;
+  TimeTraceScope &operator=(const TimeTraceScope &) = delete;
+
+ private:
+  std::string_view name_;
+  std::string_view detail_;
+  bool active_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+} // namespace told
@@ -1,16 +1,38 @@
+#include "alloc_profile.h"
 #include "elf_utils.h"
+#include "hash.h"
+#include "parallel.h"
+#include "relocation.h"
+#include "stats.h"
+#include "time_trace.h"
 #include "told.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <cstdint>
+#include <cerrno>
 #include <cstring>
+#include <exception>
+#include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <mutex>
 #include <optional>
+#include <span>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <unordered_set>
+#include <utility>
+#include <vector>
 
 // TODO: maybe this can just be a dry-run flag or maybe specify it can be
 //       passed to stdout.
@@ -19,213 +41,1138 @@
 // N.B. - be care to ensure that lengths match input elements.
 //        compiler did not catch that there were fewer elements
 //        than were statically allocated (which zero-inits the rest).
-static const std::array<elf::SectionType, 1> ACCEPTED_SECTIONS = {
-    elf::SectionType::Text};
-static const std::array<elf::SectionType, 2> OUTPUT_SEGMENTS = {
-    elf::SectionType::Header, elf::SectionType::Text};
-static const std::array<uint8_t, 1> ACCEPTED_FLAGS = {SHF_ALLOC |
-                                                      SHF_EXECINSTR};
+// in the order they are laid out: text, then read-only data and the GOT
+// (which is filled in at link time, nothing writes it after), then writable
+// data with .bss at its end.
+static const std::array<elf::SectionType, 5> ACCEPTED_SECTIONS = {
+    elf::SectionType::Text, elf::SectionType::RoData, elf::SectionType::Got,
+    elf::SectionType::Data, elf::SectionType::Bss};
+static const std::array<uint8_t, 5> ACCEPTED_FLAGS = {
+    SHF_ALLOC | SHF_EXECINSTR, SHF_ALLOC, SHF_ALLOC, SHF_ALLOC | SHF_WRITE,
+    SHF_ALLOC | SHF_WRITE};
+static const std::array<std::string_view, 5> OUTPUT_SECTION_NAMES = {
+    ".text", ".rodata", ".got", ".data", ".bss"};
+static constexpr std::string_view BUILD_ID_SECTION_NAME = ".note.gnu.build-id";
+static constexpr std::string_view BUILD_ID_NOTE_NAME{"GNU\0", 4};
+// --build-id hashes the output in chunks of this size, in parallel.
+static constexpr size_t BUILD_ID_CHUNK_SIZE = 1 << 20;
 static const std::unordered_set<elf::SectionType> LOADABLE_SECTIONS{
-    elf::SectionType::Text};
+    elf::SectionType::Text, elf::SectionType::RoData, elf::SectionType::Got,
+    elf::SectionType::Data, elf::SectionType::Bss};
+
+namespace fs = std::filesystem;
 
 namespace told {
 
+// Collects errors from parallel link tasks so they can all be reported at once.
+struct LinkErrors {
+  std::mutex mu;
+  std::vector<std::string> messages;
+
+  void add(std::string msg) {
+    std::lock_guard<std::mutex> lock{mu};
+    messages.emplace_back(std::move(msg));
+  }
+
+  // Prints every collected error and exits if there were any.
+  void exit_if_any() {
+    if (messages.empty())
+      return;
+    // workers finish in any order, sort so the report is stable.
+    std::sort(messages.begin(), messages.end());
+    for (const auto &msg : messages)
+      std::cerr << "told: -- error: " << msg << "\n";
+    exit(1);
+  }
+};
+
+bool parse_link_option(std::string_view arg, LinkOptions &options) {
+  if (arg == "--gc-sections") {
+    options.gc_sections = true;
+    return true;
+  }
+  if (arg == "--icf") {
+    options.icf = true;
+    return true;
+  }
+  if (arg.starts_with("--symbol-ordering-file=")) {
+    // absolute, so that it still names the same file for a server.
+    options.symbol_ordering_file =
+        fs::absolute(arg.substr(23)).lexically_normal().string();
+    return true;
+  }
+  if (arg == "--build-id" || arg == "--build-id=fast") {
+    options.build_id = BuildId::Fast;
+    return true;
+  }
+  if (arg == "--build-id=sha1") {
+    options.build_id = BuildId::Sha1;
+    return true;
+  }
+  if (arg == "--build-id=none") {
+    options.build_id = BuildId::None;
+    return true;
+  }
+  if (arg == "--hugepage-text") {
+    options.hugepage_text = true;
+    return true;
+  }
+  return false;
+}
+
+std::vector<std::string> link_option_args(const LinkOptions &options) {
+  std::vector<std::string> args{};
+  if (options.gc_sections)
+    args.emplace_back("--gc-sections");
+  if (options.icf)
+    args.emplace_back("--icf");
+  if (!options.symbol_ordering_file.empty())
+    args.emplace_back("--symbol-ordering-file=" + options.symbol_ordering_file);
+  if (options.build_id == BuildId::Fast)
+    args.emplace_back("--build-id=fast");
+  else if (options.build_id == BuildId::Sha1)
+    args.emplace_back("--build-id=sha1");
+  if (options.hugepage_text)
+    args.emplace_back("--hugepage-text");
+  return args;
+}
+
 elf::ElfBinary parse_object(const std::string &file_path) {
   return elf::parse_object(file_path);
 }
 
+std::vector<elf::ElfBinary>
+parse_objects(const std::vector<std::string> &file_paths) {
+  TimeTraceScope trace{"parse_objects"};
+  AllocPhase phase{"parse_objects"};
+  std::vector<std::optional<elf::ElfBinary>> parsed(file_paths.size());
+  std::vector<std::exception_ptr> errors(file_paths.size());
+  parallel_for(file_paths.size(), [&](size_t i) {
+    TimeTraceScope trace{"parse_object", file_paths[i]};
+    try {
+      parsed[i].emplace(parse_object(file_paths[i]));
+    } catch (...) {
+      errors[i] = std::current_exception();
+    }
+  });
+
+  std::vector<elf::ElfBinary> modules{};
+  modules.reserve(file_paths.size());
+  for (size_t i = 0; i < file_paths.size(); ++i) {
+    if (errors[i])
+      std::rethrow_exception(errors[i]);
+    modules.emplace_back(std::move(*parsed[i]));
+  }
+  return modules;
+}
+
+size_t align_to(size_t offset, size_t alignment) {
+  return (offset + alignment - 1) / alignment * alignment;
+}
+
+// Reads a symbol ordering file: one symbol per line, blank lines and lines
+// starting with '#' are skipped.
+std::vector<std::string> read_symbol_ordering_file(const std::string &path) {
+  std::ifstream in{path};
+  if (!in.is_open()) {
+    std::cerr << "told: -- error: could not read symbol ordering file " << path
+              << "\n";
+    exit(1);
+  }
+  std::vector<std::string> symbols{};
+  std::string line{};
+  while (std::getline(in, line)) {
+    size_t begin = line.find_first_not_of(" \t\r");
+    if (begin == std::string::npos || line[begin] == '#')
+      continue;
+    size_t end = line.find_last_not_of(" \t\r");
+    symbols.push_back(line.substr(begin, end - begin + 1));
+  }
+  return symbols;
+}
+
+// The priority of every input section under --symbol-ordering-file, by
+// module index: the position in the file of the first symbol it defines that
+// is listed there, or UINT32_MAX if it defines none.
+std::vector<std::vector<uint32_t>> section_priorities(const Executable &e) {
+  TimeTraceScope trace{"section_priorities"};
+  std::vector<std::string> symbols =
+      read_symbol_ordering_file(e.options.symbol_ordering_file);
+  std::unordered_map<std::string_view, uint32_t> priority_of{};
+  for (size_t i = 0; i < symbols.size(); ++i)
+    priority_of.try_emplace(symbols[i], static_cast<uint32_t>(i));
+
+  std::vector<std::vector<uint32_t>> priorities(e.modules.size());
+  std::vector<std::atomic<uint8_t>> found(symbols.size());
+  parallel_for(e.modules.size(), [&](size_t m) {
+    const elf::ElfBinary &mod = e.modules[m];
+    priorities[m].assign(mod.input_sections.size(), UINT32_MAX);
+    for (size_t i = 0; i < mod.symtab_entries.size(); ++i) {
+      const elf::ElfSymbolTableEntry &ste = mod.symtab_entries[i];
+      if (ste.st_shndx == SHN_UNDEF || mod.symbol_names[i].empty() ||
+          ELF64_ST_TYPE(ste.st_info) == STT_SECTION ||
+          mod.input_section(ste.st_shndx) == nullptr)
+        continue;
+      auto it = priority_of.find(mod.symbol_names[i]);
+      if (it == priority_of.end())
+        continue;
+      found[it->second].store(1, std::memory_order_relaxed);
+      uint32_t &p = priorities[m][mod.input_section_index[ste.st_shndx]];
+      p = std::min(p, it->second);
+    }
+  });
+  for (size_t i = 0; i < symbols.size(); ++i) {
+    if (!found[i] && priority_of.at(symbols[i]) == i) {
+      std::cerr << "told: -- warning: symbol ordering file: no such symbol "
+                << symbols[i] << "\n";
+    }
+  }
+  return priorities;
+}
+
+// Lays out every kept input section, each at its required alignment within
+// its segment. Sections defining a symbol listed in --symbol-ordering-file
+// come first, in the order of the file; the rest follow module by module.
 void compute_output_offsets(Executable &e) {
-  size_t offset{};
-  for (const auto &m : e.module_order) {
-    e.text_segment_offsets.emplace(m, offset);
-    elf::Block text_section =
-        e.input_modules.at(m).sections.at(elf::SectionType::Text);
-    offset += text_section.size();
+  TimeTraceScope trace{"compute_output_offsets"};
+  AllocPhase phase{"compute_output_offsets"};
+  elf::BySectionType<size_t> segment_ends{};
+  std::vector<std::vector<size_t>> &offsets = e.section_offsets;
+  offsets.resize(e.modules.size());
+  for (size_t m = 0; m < e.modules.size(); ++m)
+    offsets[m].assign(e.modules[m].input_sections.size(), NOT_PLACED);
+  auto place = [&](size_t m, size_t i) {
+    const elf::InputSection &sec = e.modules[m].input_sections[i];
+    size_t &end = segment_ends[sec.type];
+    offsets[m][i] = align_to(end, sec.align);
+    end = offsets[m][i] + sec.size;
+  };
+
+  if (!e.options.symbol_ordering_file.empty()) {
+    std::vector<std::vector<uint32_t>> priorities = section_priorities(e);
+    std::vector<std::pair<uint32_t, SectionRef>> ordered{};
+    for (uint32_t m = 0; m < priorities.size(); ++m) {
+      for (uint32_t i = 0; i < priorities[m].size(); ++i) {
+        if (priorities[m][i] != UINT32_MAX && e.kept(m, i))
+          ordered.emplace_back(priorities[m][i], SectionRef{m, i});
+      }
+    }
+    // stable, so that sections sharing a priority (only possible when one
+    // symbol name is defined locally in several modules) keep input order.
+    std::stable_sort(ordered.begin(), ordered.end(),
+                     [](const auto &a, const auto &b) {
+                       return a.first < b.first;
+                     });
+    for (const auto &[priority, ref] : ordered)
+      place(ref.module, ref.section);
   }
+  for (size_t m = 0; m < e.modules.size(); ++m) {
+    for (size_t i = 0; i < offsets[m].size(); ++i) {
+      if (offsets[m][i] == NOT_PLACED && e.kept(m, i))
+        place(m, i);
+    }
+  }
+  // folded sections are where the section they were folded into is.
+  for (const auto &[folded, kept] : e.folded_sections)
+    offsets[folded.module][folded.section] = offsets[kept.module][kept.section];
 }
 
+// Sizes the output segments. No bytes are copied here, write_out copies each
+// input section directly into the output file.
 void merge_sections(Executable &e) {
-  for (const auto &t : ACCEPTED_SECTIONS) {
-    for (auto f : ACCEPTED_FLAGS) {
-      size_t segment_size{};
-      for (const auto &m : e.module_order) {
-        if (e.input_modules.at(m).section_headers.at(t).sh_flags == f) {
-          segment_size += e.input_modules.at(m).sections.at(t).size();
-        }
-      }
-      if (segment_size == 0)
+  TimeTraceScope trace{"merge_sections"};
+  AllocPhase phase{"merge_sections"};
+  // the end and alignment of each module's placed sections, per segment. A
+  // zero alignment means none of them is in that segment.
+  struct Extent {
+    size_t end;
+    size_t align;
+  };
+  std::vector<elf::BySectionType<Extent>> extents(e.modules.size());
+  parallel_for(e.modules.size(), [&](size_t m) {
+    const elf::ElfBinary &mod = e.modules[m];
+    const std::vector<size_t> &offsets = e.section_offsets[m];
+    elf::BySectionType<Extent> &ext = extents[m];
+    for (size_t i = 0; i < mod.input_sections.size(); ++i) {
+      const elf::InputSection &sec = mod.input_sections[i];
+      if (offsets[i] == NOT_PLACED)
         continue;
+      Extent &x = ext[sec.type];
+      x.end = std::max(x.end, offsets[i] + sec.size);
+      x.align = std::max(x.align, std::max(size_t{sec.align}, size_t{1}));
+    }
+  });
 
-      elf::Block b{};
-      b.reserve(segment_size);
-      bool filled = false;
-      for (const auto &m : e.module_order) {
-        if (e.input_modules.at(m).section_headers.at(t).sh_flags == f) {
-          b.insert(b.end(), e.input_modules.at(m).sections.at(t).begin(),
-                   e.input_modules.at(m).sections.at(t).end());
-          filled = true;
-        }
-      }
+  for (size_t t = 0; t < ACCEPTED_SECTIONS.size(); ++t) {
+    size_t segment_size{};
+    size_t segment_align{};
+    for (const auto &ext : extents) {
+      segment_size = std::max(segment_size, ext[ACCEPTED_SECTIONS[t]].end);
+      segment_align = std::max(segment_align, ext[ACCEPTED_SECTIONS[t]].align);
+    }
+
+    // no input section of this type made it into the output
+    if (segment_align == 0) {
+      continue;
+    }
+
+    auto f = ACCEPTED_FLAGS[t];
+    bool wr = f & SHF_WRITE;
+    bool alloc = f & SHF_ALLOC;
+    bool ex = f & SHF_EXECINSTR;
+    Segment s{0 /* start_addr */,    segment_size /* size */,
+              0 /* relative_offset */, true /* readable*/,
+              alloc /* loadable */,  ex /* executable */,
+              wr /* writable */,     0 /* file_offset */,
+              segment_align /* align */};
+    e.segments[ACCEPTED_SECTIONS[t]] = s;
+  }
+}
 
-      // the section block was not recorded (the flag was not encountered)
-      if (!filled) {
+void create_got(Executable &e) {
+  TimeTraceScope trace{"create_got"};
+  AllocPhase phase{"create_got"};
+  // the symbols each module needs a slot for, in the order it refers to them.
+  std::vector<std::vector<uint32_t>> wanted(e.modules.size());
+  parallel_for(e.modules.size(), [&](size_t m) {
+    const elf::ElfBinary &mod = e.modules[m];
+    for (size_t s = 0; s < mod.input_sections.size(); ++s) {
+      const elf::InputSection &sec = mod.input_sections[s];
+      if (!e.kept(m, s))
         continue;
+      for (size_t r = sec.reloc_begin; r < sec.reloc_end; ++r) {
+        const elf::Relocation &rel = mod.relocations[r];
+        // the instruction bytes in front of the field are only read for
+        // relocations inside the section, relocate_module reports the rest.
+        if (is_got_relocation(rel.type) &&
+            rel.offset + reloc_width(rel.type) <= sec.size &&
+            !can_relax_got_load(rel.type, sec.data, rel.offset))
+          wanted[m].push_back(rel.sym_index);
       }
+    }
+  });
 
-      bool wr = f & SHF_WRITE;
-      bool alloc = f & SHF_ALLOC;
-      bool ex = f & SHF_EXECINSTR;
-      size_t bsz = b.size();
-      Segment s{std::move(b) /* block */, 0 /* start_addr */,
-                bsz /* size */,           0 /* relative_offset */,
-                true /* readable*/,       alloc /* loadable */,
-                ex /* executable */,      wr /* writable */};
-      e.segments.emplace(t, s);
+  // globals get one slot however many modules use them, slots are handed
+  // out in module order so the layout doesn't depend on the threads.
+  std::unordered_map<SymbolId, uint32_t> global_slots{};
+  e.got_slots.assign(e.modules.size(), {});
+  for (size_t m = 0; m < e.modules.size(); ++m) {
+    if (wanted[m].empty())
+      continue;
+    std::vector<uint32_t> &slots = e.got_slots[m];
+    slots.assign(e.modules[m].symtab_entries.size(), NO_GOT_SLOT);
+    for (uint32_t sym_index : wanted[m]) {
+      if (slots[sym_index] != NO_GOT_SLOT)
+        continue;
+      const auto next = static_cast<uint32_t>(e.got.size());
+      const SymbolId id = e.symbol_ids[m][sym_index];
+      if (id != NO_SYMBOL)
+        slots[sym_index] = global_slots.try_emplace(id, next).first->second;
+      else
+        slots[sym_index] = next;
+      if (slots[sym_index] == next)
+        e.got.push_back(SymbolRef{static_cast<uint32_t>(m), sym_index});
     }
   }
+  // GOT_SYM needs the segment for its address even if it ends up empty.
+  const GlobalSymTableEntry *got_sym = e.g_symbol_table.find(GOT_SYM);
+  if (e.got.empty() && (got_sym == nullptr || got_sym->module != NO_MODULE))
+    return;
+  e.segments[elf::SectionType::Got] =
+      Segment{0, e.got.size() * sizeof(elf::Elf64_Addr), 0, true, true, false,
+              false, 0, alignof(elf::Elf64_Addr)};
 }
 
-void assert_no_undefined_global_symbols(const Executable &e) {
-  for (const auto &mod : e.input_modules) {
-    for (const auto &entry : mod.second.symbol_table) {
-      elf::Symbol sym = entry.first;
-      elf::ElfSymbolTableEntry curr_entry = entry.second;
+// Definitions of one symbol in two modules, found while publishing. They are
+// reported once every module is in Executable::modules: the earlier
+// definition may be in a module that is still being read.
+struct Duplicates {
+  struct Definition {
+    elf::Symbol sym;
+    uint32_t prev_module;
+    uint32_t module;
+  };
+  std::mutex mu;
+  std::vector<Definition> found;
 
-      if (ELF64_ST_BIND(curr_entry.st_info) == STB_GLOBAL &&
-          ELF64_ST_TYPE(curr_entry.st_info) == STT_NOTYPE) {
-        assert(e.g_symbol_table.find(sym) != e.g_symbol_table.end() &&
-               "Global symbol is not defined");
-      }
+  void add(elf::Symbol sym, uint32_t prev_module, uint32_t module) {
+    std::lock_guard<std::mutex> lock{mu};
+    found.push_back(Definition{sym, prev_module, module});
+  }
+
+  // in input order, whichever module happened to publish first.
+  void report(const Executable &e, LinkErrors &errors) {
+    for (auto &d : found) {
+      if (d.prev_module > d.module)
+        std::swap(d.prev_module, d.module);
+    }
+    std::sort(found.begin(), found.end(),
+              [](const Definition &a, const Definition &b) {
+                return std::pair{a.module, a.prev_module} <
+                       std::pair{b.module, b.prev_module};
+              });
+    for (const auto &d : found) {
+      errors.add("multiple definitions for symbol " + std::string{d.sym} +
+                 " (in " + e.module_name(d.prev_module) + " and " +
+                 e.module_name(d.module) + ")");
+    }
+  }
+};
+
+// Publishes the global definitions and references of `binary`, which is to be
+// module `mod` of the link, into the sharded global symbol table and records
+// the id each of them got in symbol_ids[mod]. Duplicate definitions are caught
+// as they are inserted. Runs for many modules at once.
+void publish_module(Executable &e, const elf::ElfBinary &binary, uint32_t mod,
+                    Duplicates &duplicates) {
+  TimeTraceScope trace{"publish_symbols", binary.given_path};
+  std::vector<SymbolId> &ids = e.symbol_ids[mod];
+  ids.assign(binary.symtab_entries.size(), NO_SYMBOL);
+  for (size_t s = 0; s < binary.symtab_entries.size(); ++s) {
+    const elf::ElfSymbolTableEntry &curr_entry = binary.symtab_entries[s];
+    const unsigned char bind = ELF64_ST_BIND(curr_entry.st_info);
+    if (bind != STB_GLOBAL && bind != STB_WEAK)
+      continue;
+    const elf::Symbol &sym = binary.symbol_names[s];
+    const uint64_t hash = binary.symbol_hashes[s];
+    const bool weak = bind == STB_WEAK;
+
+    if (curr_entry.st_shndx == SHN_UNDEF) {
+      ids[s] = e.g_symbol_table.reference(sym, hash, weak);
+      continue;
+    }
+    // symbols outside of the sections told links (absolute ones, or in
+    // .tdata) have no type, and so no address.
+    const elf::InputSection *sec = binary.input_section(curr_entry.st_shndx);
+    SymbolTable::Defined def = e.g_symbol_table.define(
+        sym, hash,
+        GlobalSymTableEntry{
+            mod,
+            sec != nullptr ? binary.input_section_index[sec->shndx]
+                           : elf::NO_INPUT_SECTION,
+            curr_entry.st_value, 0,
+            sec != nullptr ? sec->type : elf::SectionType::None, true, weak,
+            false});
+    ids[s] = def.id;
+    if (def.prev_def.has_value())
+      duplicates.add(sym, *def.prev_def, mod);
+  }
+}
+
+// Publishes the symbols of modules[begin, end), which were parsed before the
+// link started, one module per task.
+void publish_symbols(Executable &e, size_t begin, size_t end,
+                     LinkErrors &errors) {
+  size_t symbols{};
+  for (size_t i = begin; i < end; ++i) {
+    const elf::ElfBinary &binary = e.modules[i];
+    // room for the definitions only: references mostly name symbols that
+    // are defined somewhere, counting them too would size the table for
+    // every use.
+    symbols += static_cast<size_t>(std::count_if(
+        binary.symtab_entries.begin(), binary.symtab_entries.end(),
+        [](const elf::ElfSymbolTableEntry &ste) {
+          return ELF64_ST_BIND(ste.st_info) != STB_LOCAL &&
+                 ste.st_shndx != SHN_UNDEF;
+        }));
+  }
+  e.g_symbol_table.reserve(symbols);
+  e.symbol_ids.resize(end);
+
+  Duplicates duplicates{};
+  parallel_for(end - begin, [&](size_t i) {
+    const auto mod = static_cast<uint32_t>(begin + i);
+    publish_module(e, e.modules[mod], mod, duplicates);
+  });
+  duplicates.report(e, errors);
+}
+
+// Appends `n` modules, made by parse(i), to the link in order. Each task
+// parses its module and publishes its symbols right away, so resolving
+// overlaps with reading the inputs that are still being parsed. Returns the
+// exception each parse(i) threw, if any; the link can't go on after one.
+template <typename Parse>
+std::vector<std::exception_ptr> add_modules(Executable &e, size_t n,
+                                            Parse &&parse,
+                                            LinkErrors &errors) {
+  const size_t begin = e.modules.size();
+  e.symbol_ids.resize(begin + n);
+  std::vector<std::optional<elf::ElfBinary>> parsed(n);
+  std::vector<std::exception_ptr> failures(n);
+  Duplicates duplicates{};
+  parallel_for(n, [&](size_t i) {
+    try {
+      parsed[i].emplace(parse(i));
+    } catch (...) {
+      failures[i] = std::current_exception();
+      return;
     }
+    publish_module(e, *parsed[i], static_cast<uint32_t>(begin + i),
+                   duplicates);
+  });
+  if (std::any_of(failures.begin(), failures.end(),
+                  [](const std::exception_ptr &f) { return f != nullptr; }))
+    return failures;
+  e.modules.reserve(begin + n);
+  for (auto &mod : parsed)
+    e.modules.push_back(std::move(*mod));
+  duplicates.report(e, errors);
+  return failures;
+}
+
+void add_objects(Executable &e, const std::vector<std::string> &file_paths) {
+  TimeTraceScope trace{"add_objects"};
+  AllocPhase phase{"add_objects"};
+  LinkErrors errors{};
+  std::vector<std::exception_ptr> failures =
+      add_modules(e, file_paths.size(), [&](size_t i) {
+        TimeTraceScope trace{"parse_object", file_paths[i]};
+        return parse_object(file_paths[i]);
+      }, errors);
+  for (const auto &failure : failures) {
+    if (failure)
+      std::rethrow_exception(failure);
   }
+  errors.exit_if_any();
 }
 
+// Finds the archive members that define a currently undefined symbol and
+// haven't been loaded yet, as (archive, member offset) pairs in archive order.
+// Like other linkers, weak references alone don't pull members in.
+std::vector<std::pair<size_t, size_t>>
+wanted_members(const Executable &e,
+               const std::vector<std::unordered_set<size_t>> &loaded) {
+  std::vector<std::pair<size_t, size_t>> wanted{};
+  e.g_symbol_table.for_each(
+      [&](const elf::Symbol &sym, const GlobalSymTableEntry &entry) {
+        if (entry.defined || !entry.strong_ref)
+          return;
+        for (size_t a = 0; a < e.archives.size(); ++a) {
+          auto it = e.archives[a].index.find(sym);
+          if (it == e.archives[a].index.end())
+            continue;
+          if (!loaded[a].contains(it->second))
+            wanted.emplace_back(a, it->second);
+          break;
+        }
+      });
+  // the table is walked in hash order, sort so the output doesn't depend on
+  // it.
+  std::sort(wanted.begin(), wanted.end());
+  wanted.erase(std::unique(wanted.begin(), wanted.end()), wanted.end());
+  return wanted;
+}
+
+// Builds the global symbol table from the input objects, then keeps pulling
+// in archive members that define still-undefined symbols (which may in turn
+// reference more) until nothing new is needed. Whatever is still only
+// referenced after that is undefined, unless every reference is weak.
 void create_global_symtab(Executable &e) {
-  std::unordered_map<elf::Symbol, GlobalSymTableEntry> g_sym{};
-  for (const auto &mod : e.input_modules) {
-    for (const auto &entry : mod.second.symbol_table) {
-      const elf::Symbol &sym = entry.first;
-      const elf::ElfSymbolTableEntry &curr_entry = entry.second;
-
-      if (ELF64_ST_BIND(curr_entry.st_info) == STB_GLOBAL &&
-          ELF64_ST_TYPE(curr_entry.st_info) != STT_NOTYPE) {
-        assert(g_sym.find(sym) == g_sym.end() &&
-               "Multiple definitions for symbol found");
-        // TODO: it's not generally always the text type.
-        g_sym.emplace(sym, GlobalSymTableEntry{mod.first, curr_entry.st_value,
-                                               0, elf::SectionType::Text});
+  TimeTraceScope trace{"create_global_symtab"};
+  LinkErrors errors{};
+  std::vector<std::unordered_set<size_t>> loaded(e.archives.size());
+  // modules added with add_objects already have their symbols published.
+  if (e.symbol_ids.size() < e.modules.size())
+    publish_symbols(e, e.symbol_ids.size(), e.modules.size(), errors);
+  for (;;) {
+    std::vector<std::pair<size_t, size_t>> wanted = wanted_members(e, loaded);
+    if (wanted.empty())
+      break;
+    TimeTraceScope trace{"extract_members"};
+    std::vector<std::exception_ptr> failures =
+        add_modules(e, wanted.size(), [&](size_t i) {
+          return elf::parse_archive_member(e.archives[wanted[i].first],
+                                           wanted[i].second);
+        }, errors);
+    for (const auto &failure : failures) {
+      try {
+        if (failure)
+          std::rethrow_exception(failure);
+      } catch (const std::exception &err) {
+        errors.add(err.what());
       }
     }
+    errors.exit_if_any();
+    for (const auto &[archive, member] : wanted)
+      loaded[archive].insert(member);
   }
-  e.g_symbol_table = std::move(g_sym);
-  assert_no_undefined_global_symbols(e);
+
+  const GlobalSymTableEntry *got_sym = e.g_symbol_table.find(GOT_SYM);
+  if (got_sym != nullptr && !got_sym->defined) {
+    e.g_symbol_table.define(
+        GOT_SYM, GlobalSymTableEntry{NO_MODULE, elf::NO_INPUT_SECTION, 0, 0,
+                                     elf::SectionType::Got, true, false,
+                                     false});
+  }
+  e.g_symbol_table.for_each(
+      [&](const elf::Symbol &sym, const GlobalSymTableEntry &entry) {
+        if (!entry.defined && entry.strong_ref)
+          errors.add("undefined symbol " + std::string{sym});
+      });
+  errors.exit_if_any();
 }
 
 void resolve_symbols(Executable &e) {
+  TimeTraceScope trace{"resolve_symbols"};
+  AllocPhase phase{"resolve_symbols"};
   create_global_symtab(e);
-  assert(e.g_symbol_table.find(ENTRY_SYM) != e.g_symbol_table.end() &&
+  assert(e.g_symbol_table.find(ENTRY_SYM) != nullptr &&
          "_start entrypoint needs to exist");
+  if (stats_enabled()) {
+    uint64_t defined{};
+    uint64_t undefined{};
+    e.g_symbol_table.for_each([&](const elf::Symbol &, const auto &entry) {
+      ++(entry.defined ? defined : undefined);
+    });
+    add_stat(Stat::GlobalSymbols, defined);
+    add_stat(Stat::UndefinedSymbols, undefined);
+  }
 }
 
-size_t padding_sz(size_t offset) {
-  size_t alignment = offset % TOLD_PAGE_SIZE;
+// The input sections of a resolved link, for the passes that follow
+// relocations from section to section.
+struct SectionGraph {
+  const Executable &e;
+  const std::vector<elf::ElfBinary> &mods;
+
+  explicit SectionGraph(const Executable &e) : e(e), mods(e.modules) {}
+
+  // What a relocation in module `m` against `sym_index` refers to: the input
+  // section the symbol is defined in and the symbol's offset in it. Globals
+  // are looked up in the symbol table so that they lead to the definition
+  // resolution picked, by the id publish_symbols recorded.
+  std::optional<std::pair<SectionRef, elf::Elf64_Addr>>
+  target(uint32_t m, elf::Elf64_Word sym_index) const {
+    const elf::ElfBinary &mod = mods[m];
+    const elf::ElfSymbolTableEntry &ste = mod.symtab_entries[sym_index];
+    if (ELF64_ST_BIND(ste.st_info) != STB_LOCAL) {
+      SymbolId id = e.symbol_ids[m][sym_index];
+      if (id == NO_SYMBOL)
+        return std::nullopt;
+      const GlobalSymTableEntry &g_sym = e.g_symbol_table.entry(id);
+      if (g_sym.section == elf::NO_INPUT_SECTION)
+        return std::nullopt;
+      return std::make_pair(SectionRef{g_sym.module, g_sym.section},
+                            g_sym.value);
+    }
+    if (mod.input_section(ste.st_shndx) == nullptr)
+      return std::nullopt;
+    return std::make_pair(SectionRef{m, mod.input_section_index[ste.st_shndx]},
+                          ste.st_value);
+  }
+
+  // The current fate of every input section, by module index. Sections that
+  // no pass has touched yet are `initial`.
+  std::vector<std::vector<SectionFate>> fates(SectionFate initial) const {
+    std::vector<std::vector<SectionFate>> fates(mods.size());
+    for (size_t i = 0; i < mods.size(); ++i) {
+      if (i < e.section_fates.size() && !e.section_fates[i].empty())
+        fates[i] = e.section_fates[i];
+      else
+        fates[i].assign(mods[i].input_sections.size(), initial);
+    }
+    return fates;
+  }
+};
+
+void store_fates(Executable &e, std::vector<std::vector<SectionFate>> &&fates) {
+  e.section_fates = std::move(fates);
+}
+
+void gc_sections(Executable &e) {
+  TimeTraceScope trace{"gc_sections"};
+  AllocPhase phase{"gc_sections"};
+  SectionGraph g{e};
+  std::vector<std::vector<SectionFate>> fates{};
+  fates.reserve(g.mods.size());
+  for (const auto &mod : g.mods)
+    fates.emplace_back(mod.input_sections.size(), SectionFate::Dropped);
+  // true for the one caller that gets to mark `r` kept.
+  auto claim = [&](SectionRef r) {
+    return std::atomic_ref<SectionFate>{fates[r.module][r.section]}.exchange(
+               SectionFate::Kept, std::memory_order_relaxed) !=
+           SectionFate::Kept;
+  };
+
+  // Marked breadth first, one level of the reference graph at a time. All the
+  // sections in a level are scanned in parallel, each claiming the sections
+  // it refers to so that every section is only scanned once.
+  std::vector<SectionRef> level{};
+  const GlobalSymTableEntry &entry = e.g_symbol_table.at(ENTRY_SYM);
+  if (entry.section != elf::NO_INPUT_SECTION) {
+    SectionRef root{entry.module, entry.section};
+    claim(root);
+    level.push_back(root);
+  }
+  while (!level.empty()) {
+    std::vector<std::vector<SectionRef>> found(level.size());
+    parallel_for(level.size(), [&](size_t i) {
+      const elf::ElfBinary &mod = g.mods[level[i].module];
+      const elf::InputSection &sec = mod.input_sections[level[i].section];
+      for (size_t r = sec.reloc_begin; r < sec.reloc_end; ++r) {
+        auto target = g.target(level[i].module, mod.relocations[r].sym_index);
+        if (target.has_value() && claim(target->first))
+          found[i].push_back(target->first);
+      }
+    });
+    level.clear();
+    for (const auto &f : found)
+      level.insert(level.end(), f.begin(), f.end());
+  }
+  store_fates(e, std::move(fates));
+}
+
+uint64_t hash_combine(uint64_t h, uint64_t v) {
+  return h ^ (v + 0x9e3779b97f4a7c15 + (h << 6) + (h >> 2));
+}
+
+void fold_identical_code(Executable &e) {
+  TimeTraceScope trace{"fold_identical_code"};
+  AllocPhase phase{"fold_identical_code"};
+  SectionGraph g{e};
+  std::vector<std::vector<SectionFate>> fates = g.fates(SectionFate::Kept);
+
+  // every kept executable section takes part, numbered in input order.
+  std::vector<SectionRef> sections{};
+  std::vector<std::vector<uint32_t>> number(g.mods.size());
+  for (uint32_t m = 0; m < g.mods.size(); ++m) {
+    const elf::ElfBinary &mod = g.mods[m];
+    number[m].assign(mod.input_sections.size(), elf::NO_INPUT_SECTION);
+    for (uint32_t s = 0; s < mod.input_sections.size(); ++s) {
+      if (fates[m][s] != SectionFate::Kept ||
+          mod.input_sections[s].type != elf::SectionType::Text ||
+          mod.input_sections[s].data.empty())
+        continue;
+      number[m][s] = static_cast<uint32_t>(sections.size());
+      sections.push_back(SectionRef{m, s});
+    }
+  }
+  const size_t n = sections.size();
+
+  // Each relocation's target, as the number of the section it points into
+  // (or a unique stand-in for sections that can't fold) and the offset in it.
+  // A section with a relocation that doesn't point into an input section at
+  // all is never folded.
+  struct Edge {
+    uint64_t target;
+    elf::Elf64_Addr offset;
+  };
+  std::vector<std::vector<Edge>> edges(n);
+  std::vector<uint8_t> foldable(n, 1);
+  // class of each section: starts out as a hash of everything that can be
+  // compared directly and is refined with the classes of its targets.
+  std::vector<uint64_t> classes(n);
+  parallel_for(n, [&](size_t i) {
+    const SectionRef ref = sections[i];
+    const elf::ElfBinary &mod = g.mods[ref.module];
+    const elf::InputSection &sec = mod.input_sections[ref.section];
+    uint64_t h = std::hash<std::string_view>{}(
+        std::string_view{sec.data.data(), sec.data.size()});
+    h = hash_combine(h, sec.align);
+    for (size_t r = sec.reloc_begin; r < sec.reloc_end; ++r) {
+      const elf::Relocation &rel = mod.relocations[r];
+      auto target = g.target(ref.module, rel.sym_index);
+      if (!target.has_value()) {
+        foldable[i] = 0;
+        break;
+      }
+      auto [to, offset] = *target;
+      uint64_t num = number[to.module][to.section];
+      if (num == elf::NO_INPUT_SECTION)
+        num = (uint64_t{1} << 63) | (uint64_t{to.module} << 32) | to.section;
+      edges[i].push_back(Edge{num, offset});
+      h = hash_combine(h, rel.offset);
+      h = hash_combine(h, rel.type);
+      h = hash_combine(h, static_cast<uint64_t>(rel.addend));
+      h = hash_combine(h, offset);
+    }
+    // a section that can't fold is in a class of its own.
+    classes[i] = foldable[i] ? h : i;
+  });
+  auto class_of = [&](uint64_t target) {
+    return target < n ? classes[target] : target;
+  };
+  auto count_classes = [&]() {
+    std::vector<uint64_t> sorted{classes};
+    std::sort(sorted.begin(), sorted.end());
+    return static_cast<size_t>(
+        std::unique(sorted.begin(), sorted.end()) - sorted.begin());
+  };
+
+  // Sections can only be identical if what they refer to is too, so each
+  // round mixes the classes of a section's targets into its own. Once a
+  // round doesn't split any class further, the classes are final.
+  size_t class_count = count_classes();
+  for (size_t round = 1;; ++round) {
+    TimeTraceScope trace{"icf_round", std::to_string(round)};
+    std::vector<uint64_t> next(n);
+    parallel_for(n, [&](size_t i) {
+      if (!foldable[i]) {
+        next[i] = classes[i];
+        return;
+      }
+      uint64_t h = classes[i];
+      for (const Edge &edge : edges[i])
+        h = hash_combine(h, class_of(edge.target));
+      next[i] = h;
+    });
+    classes = std::move(next);
+    size_t count = count_classes();
+    if (count == class_count)
+      break;
+    class_count = count;
+  }
+
+  // Equal hashes are checked for real before folding, in case they collided.
+  auto identical = [&](size_t a, size_t b) {
+    const elf::ElfBinary &ma = g.mods[sections[a].module];
+    const elf::ElfBinary &mb = g.mods[sections[b].module];
+    const elf::InputSection &sa = ma.input_sections[sections[a].section];
+    const elf::InputSection &sb = mb.input_sections[sections[b].section];
+    if (sa.data.size() != sb.data.size() || sa.align != sb.align ||
+        edges[a].size() != edges[b].size() ||
+        std::memcmp(sa.data.data(), sb.data.data(), sa.data.size()) != 0)
+      return false;
+    for (size_t r = 0; r < edges[a].size(); ++r) {
+      const elf::Relocation &ra = ma.relocations[sa.reloc_begin + r];
+      const elf::Relocation &rb = mb.relocations[sb.reloc_begin + r];
+      if (ra.offset != rb.offset || ra.type != rb.type ||
+          ra.addend != rb.addend ||
+          edges[a][r].offset != edges[b][r].offset ||
+          class_of(edges[a][r].target) != class_of(edges[b][r].target))
+        return false;
+    }
+    return true;
+  };
+
+  // the first section of each class, in input order, is the one kept.
+  std::vector<uint32_t> order(n);
+  for (uint32_t i = 0; i < n; ++i)
+    order[i] = i;
+  std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return classes[a] != classes[b] ? classes[a] < classes[b] : a < b;
+  });
+  for (size_t i = 0; i < n;) {
+    size_t j = i + 1;
+    while (j < n && classes[order[j]] == classes[order[i]])
+      ++j;
+    for (size_t k = i + 1; k < j; ++k) {
+      if (!foldable[order[i]] || !identical(order[i], order[k]))
+        continue;
+      const SectionRef folded = sections[order[k]];
+      fates[folded.module][folded.section] = SectionFate::Folded;
+      e.folded_sections.emplace_back(folded, sections[order[i]]);
+    }
+    i = j;
+  }
+  store_fates(e, std::move(fates));
+}
+
+std::string to_hex(uint64_t v) {
+  std::ostringstream os{};
+  os << std::hex << v;
+  return os.str();
+}
+
+size_t padding_sz(size_t offset, size_t page_size = TOLD_PAGE_SIZE) {
+  size_t alignment = offset % page_size;
   if (alignment == 0)
     return 0;
-  return TOLD_PAGE_SIZE - alignment;
+  return page_size - alignment;
 }
 
-std::optional<std::vector<char>> padding(size_t offset) {
-  size_t p_sz{padding_sz(offset)};
-  if (p_sz == 0)
-    return std::nullopt;
-  size_t to_pad{p_sz};
+bool same_permissions(const Segment &a, const Segment &b) {
+  return a.executable == b.executable && a.writable == b.writable;
+}
+
+// The page size a segment is loaded with. With --hugepage-text, executable
+// segments get huge pages of their own: they start on a huge page boundary
+// and whatever follows them starts on the next one.
+size_t page_size(const Executable &e, const Segment &sg) {
+  return e.options.hugepage_text && sg.executable ? TOLD_HUGE_PAGE_SIZE
+                                                  : TOLD_PAGE_SIZE;
+}
 
-  std::vector<char> pad(to_pad);
-  std::fill(pad.begin(), pad.end(), '\0');
-  return pad;
+// The segment of type `t` if it has any contents. Segments made up of empty
+// input sections only get an address, for the symbols in them; they have no
+// headers.
+const Segment *output_segment(const Executable &e, elf::SectionType t) {
+  const std::optional<Segment> &sg = e.segments[t];
+  if (!sg.has_value() || sg->size == 0)
+    return nullptr;
+  return &*sg;
+}
+
+// The segments that made it into the output, header first, grouped into one
+// PT_LOAD per run of segments with the same permissions.
+std::vector<std::vector<elf::SectionType>>
+load_segments(const Executable &e) {
+  std::vector<std::vector<elf::SectionType>> loads{{elf::SectionType::Header}};
+  const Segment *prev = &e.segment(elf::SectionType::Header);
+  for (const auto &t : ACCEPTED_SECTIONS) {
+    const Segment *sg = output_segment(e, t);
+    if (sg == nullptr)
+      continue;
+    if (!same_permissions(*prev, *sg))
+      loads.emplace_back();
+    loads.back().push_back(t);
+    prev = sg;
+  }
+  return loads;
+}
+
+size_t build_id_size(BuildId kind) {
+  switch (kind) {
+  case BuildId::Fast:
+    return sizeof(uint64_t);
+  case BuildId::Sha1:
+    return std::tuple_size_v<Sha1::Digest>;
+  default:
+    return 0;
+  }
+}
+
+// .note.gnu.build-id is namesz, descsz and type, then BUILD_ID_NOTE_NAME and
+// the id. It lives in the header segment, right after the program headers.
+size_t build_id_note_size(const Executable &e) {
+  size_t n = build_id_size(e.options.build_id);
+  if (n == 0)
+    return 0;
+  return 3 * sizeof(elf::Elf64_Word) + BUILD_ID_NOTE_NAME.size() + n;
+}
+
+size_t program_header_count(const Executable &e) {
+  return load_segments(e).size() + (build_id_note_size(e) != 0 ? 1 : 0);
+}
+
+size_t build_id_note_offset(const Executable &e) {
+  return sizeof(elf::ElfHeader) +
+         program_header_count(e) * sizeof(elf::ElfProgramHeader);
 }
 
 void apply_addrs_and_adjustments_to_segments(Executable &e) {
-  Segment &e_header = e.segments.at(elf::SectionType::Header);
-  e_header.size = sizeof(elf::ElfHeader) +
-                  (e.segments.size() * sizeof(elf::ElfProgramHeader));
+  TimeTraceScope trace{"apply_addrs_and_adjustments_to_segments"};
+  AllocPhase phase{"apply_addrs_and_adjustments_to_segments"};
+  Segment &e_header = e.segment(elf::SectionType::Header);
+  e_header.size = build_id_note_offset(e) + build_id_note_size(e);
   e_header.loadable = true;
 
-  size_t addr{e.segments.at(elf::SectionType::Header).start_addr +
-              e.segments.at(elf::SectionType::Header).size};
+  size_t addr{e_header.start_addr + e_header.size};
+  size_t file_offset{e_header.size};
+  const Segment *prev = &e_header;
   for (const auto &t : ACCEPTED_SECTIONS) {
-    Segment &s = e.segments.at(t);
+    if (!e.segments[t].has_value())
+      continue;
+    Segment &s = *e.segments[t];
     s.loadable = LOADABLE_SECTIONS.find(t) != LOADABLE_SECTIONS.end();
-    addr += padding_sz(addr);
+    if (s.size == 0) {
+      s.start_addr = addr;
+      s.file_offset = file_offset;
+      continue;
+    }
+    if (same_permissions(*prev, s)) {
+      // shares its pages with the previous segment.
+      addr = align_to(addr, s.align);
+      file_offset = align_to(file_offset, s.align);
+    } else {
+      // addr and file_offset stay congruent modulo the page size, the loader
+      // maps the file in pages.
+      size_t page = std::max(page_size(e, *prev), page_size(e, s));
+      addr += padding_sz(addr, page);
+      file_offset += padding_sz(file_offset, page);
+    }
     s.start_addr = addr;
     addr += s.size;
+    s.file_offset = file_offset;
+    if (t != elf::SectionType::Bss)
+      file_offset += s.size;
+    prev = &s;
   }
 }
 
+// Address of input section `i` of a module laid out at `offsets`, if it made
+// it into the output.
+std::optional<elf::Elf64_Addr>
+section_addr(const Executable &e, const elf::ElfBinary &mod,
+             const std::vector<size_t> &offsets, size_t i) {
+  if (offsets[i] == NOT_PLACED)
+    return std::nullopt;
+  return e.segment(mod.input_sections[i].type).start_addr + offsets[i];
+}
+
 void apply_addrs_to_symbols(Executable &e) {
-  for (auto &g_sym : e.g_symbol_table) {
-    const std::string &mod = g_sym.second.def_module;
-    size_t offset{e.text_segment_offsets.at(mod)};
-    if (g_sym.second.type == elf::SectionType::Text) {
-      const Segment &sg = e.segments.at(elf::SectionType::Text);
-      g_sym.second.addr = offset + g_sym.second.value + sg.start_addr;
-    }
+  TimeTraceScope trace{"apply_addrs_to_symbols"};
+  AllocPhase phase{"apply_addrs_to_symbols"};
+  e.g_symbol_table.parallel_for_each(
+      [&](const elf::Symbol &, GlobalSymTableEntry &g_sym) {
+        if (g_sym.type == elf::SectionType::None)
+          return;
+        if (g_sym.module == NO_MODULE) {
+          g_sym.addr = e.segment(g_sym.type).start_addr + g_sym.value;
+          return;
+        }
+        size_t offset{e.section_offsets[g_sym.module][g_sym.section]};
+        // only dead code can refer to symbols in sections that were dropped.
+        if (offset != NOT_PLACED)
+          g_sym.addr = e.segment(g_sym.type).start_addr + offset + g_sym.value;
+      });
+}
+
+// Address of the symbol that relocations in `mod` refer to by `sym_index`,
+// given where the module's input sections end up. Globals come from their
+// global symbol table entry (by the module's `ids`), locals (including
+// section symbols) are relative to their section.
+std::optional<elf::Elf64_Addr>
+reloc_symbol_addr(const Executable &e, const elf::ElfBinary &mod,
+                  const std::vector<size_t> &offsets,
+                  const std::vector<SymbolId> &ids,
+                  elf::Elf64_Word sym_index) {
+  const elf::ElfSymbolTableEntry &ste = mod.symtab_entries[sym_index];
+  if (ELF64_ST_BIND(ste.st_info) != STB_LOCAL) {
+    if (ids[sym_index] == NO_SYMBOL)
+      return std::nullopt;
+    const GlobalSymTableEntry &g_sym = e.g_symbol_table.entry(ids[sym_index]);
+    // only weak references are left undefined by resolution.
+    if (!g_sym.defined)
+      return 0;
+    if (g_sym.type == elf::SectionType::None)
+      return std::nullopt;
+    return g_sym.addr;
   }
+  if (ste.st_shndx >= mod.input_section_index.size() ||
+      mod.input_section_index[ste.st_shndx] == elf::NO_INPUT_SECTION)
+    return std::nullopt;
+  std::optional<elf::Elf64_Addr> addr =
+      section_addr(e, mod, offsets, mod.input_section_index[ste.st_shndx]);
+  if (!addr.has_value())
+    return std::nullopt;
+  return *addr + ste.st_value;
 }
 
-void update_block_content_with_reloc(std::vector<char> &block, size_t offset,
-                                     uint32_t addr) {
-  std::memcpy(&block[offset], &addr, sizeof(addr));
+elf::Elf64_Addr got_slot_addr(const Executable &e, size_t module,
+                              elf::Elf64_Word sym_index) {
+  return e.segment(elf::SectionType::Got).start_addr +
+         e.got_slots[module][sym_index] * sizeof(elf::Elf64_Addr);
 }
 
-void apply_relocations(Executable &e) {
-  for (const auto &m : e.input_modules) {
-    for (const auto &reloc : m.second.rela_entries) {
-      const std::string &sym = reloc.first;
-      const auto rela_offset = reloc.second.r_offset;
-      const elf::Elf64_Addr sym_addr = e.g_symbol_table.at(sym).addr;
-      const size_t text_sg_start_addr =
-          e.segments.at(elf::SectionType::Text).start_addr;
-      const size_t text_sg_offset = e.text_segment_offsets.at(m.first);
-      const size_t next_instr_addr =
-          text_sg_offset + text_sg_start_addr + rela_offset;
+// Patches module `i`'s input sections, already copied to their place in
+// `out` (an image of the output file).
+void relocate_module(const Executable &e, size_t i, char *out,
+                     LinkErrors &errors) {
+  const elf::ElfBinary &mod = e.modules[i];
+  TimeTraceScope trace{"relocate_module", mod.given_path};
+  const std::vector<size_t> &offsets = e.section_offsets[i];
+  const std::vector<SymbolId> &ids = e.symbol_ids[i];
 
-      uint32_t new_addr = static_cast<uint32_t>(sym_addr - next_instr_addr +
-                                                reloc.second.r_addend);
-      update_block_content_with_reloc(
-          e.segments.at(elf::SectionType::Text).block,
-          static_cast<size_t>(text_sg_offset + rela_offset), new_addr);
+  // resolve each referenced symbol once, not once per relocation.
+  std::vector<std::optional<elf::Elf64_Addr>> sym_addrs(
+      mod.symtab_entries.size());
+  // --stats counts, added once the whole module is done.
+  const bool stats = stats_enabled();
+  std::array<uint64_t, STAT_RELOC_TYPES> applied{};
+  uint64_t relaxed{};
+  for (size_t s = 0; s < mod.input_sections.size(); ++s) {
+    if (!e.kept(i, s))
+      continue;
+    const elf::InputSection &sec = mod.input_sections[s];
+    const size_t sec_addr = *section_addr(e, mod, offsets, s);
+    char *sec_out = out + e.segment(sec.type).file_offset + offsets[s];
+    for (size_t ri = sec.reloc_begin; ri < sec.reloc_end; ++ri) {
+      const elf::Relocation &r = mod.relocations[ri];
+      std::optional<elf::Elf64_Addr> &sym_addr = sym_addrs[r.sym_index];
+      if (!sym_addr.has_value())
+        sym_addr = reloc_symbol_addr(e, mod, offsets, ids, r.sym_index);
+      auto where = [&]() {
+        return mod.given_path + ":" + std::string{sec.name} + "+0x" +
+               to_hex(r.offset);
+      };
+      if (!sym_addr.has_value()) {
+        errors.add(where() + ": can't resolve symbol '" +
+                   std::string{mod.symbol_names[r.sym_index]} + "'");
+        continue;
+      }
+      if (r.offset + reloc_width(r.type) > sec.size) {
+        errors.add(where() + ": relocation is outside of its section");
+        continue;
+      }
+
+      // everything is resolved statically, so GOT relocations become direct
+      // references wherever the instruction allows it, the rest point at
+      // the symbol's GOT slot. Either way what's left is PC-relative.
+      elf::Elf64_Word type = r.type;
+      elf::Elf64_Addr target = *sym_addr;
+      if (is_got_relocation(r.type)) {
+        if (can_relax_got_load(r.type, sec.data, r.offset)) {
+          relax_got_load(sec_out + r.offset);
+          ++relaxed;
+        } else {
+          target = got_slot_addr(e, i, r.sym_index);
+        }
+        type = R_X86_64_PC32;
+      }
+      RelocResult res = apply_relocation(type, sec_out + r.offset, target,
+                                         r.addend, sec_addr + r.offset);
+      if (res == RelocResult::Ok && stats) {
+        ++applied[std::min(r.type, STAT_RELOC_TYPES - 1)];
+      } else if (res == RelocResult::Overflow) {
+        errors.add(where() + ": relocation type " + std::to_string(r.type) +
+                   " against '" + std::string{mod.symbol_names[r.sym_index]} +
+                   "' is out of range");
+      } else if (res == RelocResult::Unsupported) {
+        errors.add(where() + ": unsupported relocation type " +
+                   std::to_string(r.type));
+      }
     }
   }
+  if (stats) {
+    for (uint32_t t = 0; t < STAT_RELOC_TYPES; ++t)
+      add_relocation_stat(t, applied[t]);
+    add_stat(Stat::RelaxedGotLoads, relaxed);
+  }
+}
+
+// Each module only writes to its own input sections, so modules are patched
+// in parallel.
+void relocate_modules(const Executable &e, char *out, LinkErrors &errors) {
+  TimeTraceScope trace{"apply_relocations"};
+  parallel_for(e.modules.size(),
+               [&](size_t i) { relocate_module(e, i, out, errors); });
+}
+
+void apply_relocations(const Executable &e, char *out) {
+  LinkErrors errors{};
+  relocate_modules(e, out, errors);
+  errors.exit_if_any();
+}
+
+bool try_apply_relocations(const Executable &e, char *out) {
+  LinkErrors errors{};
+  relocate_modules(e, out, errors);
+  return errors.messages.empty();
 }
 
 Executable
-init_exec(std::string &&output_path, std::vector<std::string> &&module_order,
-          std::unordered_map<std::string, elf::ElfBinary> &&modules) {
+init_exec(std::string &&output_path, std::vector<elf::ElfBinary> &&modules,
+          std::vector<elf::Archive> &&archives, const LinkOptions &options) {
   Executable e{};
-  e.module_order = std::move(module_order);
-  e.input_modules = std::move(modules);
+  e.modules = std::move(modules);
+  e.archives = std::move(archives);
+  e.options = options;
   e.path = std::move(output_path);
-  elf::Block empty{};
-  e.segments.emplace(elf::SectionType::Header,
-                     Segment{std::move(empty), TOLD_START_ADDR, 0, 0, true,
-                             false, false, false});
+  e.segments[elf::SectionType::Header] =
+      Segment{TOLD_START_ADDR, 0, 0, true, false, false, false, 0, 1};
   return e;
 }
 
+// The section headers go on the first page after the last segment's bytes.
 size_t compute_section_header_offset(const Executable &e) {
-  size_t header_size = sizeof(elf::ElfHeader) +
-                       sizeof(elf::ElfProgramHeader) * e.segments.size();
-  size_t pad_between_header_segments = padding_sz(header_size);
-  size_t pad_after_segments{};
-  size_t segments_size{};
-  for (const auto &t : ACCEPTED_SECTIONS) {
-    segments_size = e.segments.at(t).block.size();
-    pad_after_segments += padding_sz(segments_size);
+  size_t end{};
+  for (size_t t = 0; t < elf::SECTION_TYPE_COUNT; ++t) {
+    const std::optional<Segment> &sg = e.segments.items[t];
+    if (sg.has_value() && t != static_cast<size_t>(elf::SectionType::Bss))
+      end = std::max(end, sg->file_offset + sg->size);
   }
-
-  return header_size + pad_between_header_segments + segments_size +
-         pad_after_segments;
+  return end + padding_sz(end);
 }
 
 void add_elf_header(Executable &e) {
@@ -248,7 +1195,7 @@ void add_elf_header(Executable &e) {
   eh.e_flags = 0; // this is apparently the correct value for x86 arch.
   eh.e_ehsize = sizeof(elf::ElfHeader);
   eh.e_phentsize = sizeof(elf::ElfProgramHeader);
-  eh.e_phnum = static_cast<elf::Elf64_Half>(e.segments.size());
+  eh.e_phnum = static_cast<elf::Elf64_Half>(e.program_headers.size());
   eh.e_shentsize = sizeof(elf::ElfSectionHeader);
   eh.e_shnum = static_cast<elf::Elf64_Half>(e.section_headers.size());
 
@@ -259,22 +1206,41 @@ void add_elf_header(Executable &e) {
 
 std::vector<elf::ElfProgramHeader> create_program_headers(const Executable &e) {
   std::vector<elf::ElfProgramHeader> phs{};
-  phs.reserve(e.segments.size());
-  size_t i{};
-  for (const auto &t : OUTPUT_SEGMENTS) {
-    Segment sg = e.segments.at(t);
+  for (const auto &load : load_segments(e)) {
+    const Segment &sg = e.segment(load.front());
+    const Segment &last = e.segment(load.back());
+    // .bss, if it is in there, is at the end and has no bytes in the file.
+    size_t file_end = sg.file_offset;
+    for (const auto &t : load) {
+      const Segment &part = e.segment(t);
+      if (t != elf::SectionType::Bss)
+        file_end = part.file_offset + part.size;
+    }
     elf::ElfProgramHeader ph{};
     ph.p_type = sg.loadable ? PT_LOAD : PT_NULL;
     ph.p_flags = sg.executable ? PF_X : 0;
+    ph.p_flags = ph.p_flags | (sg.writable ? PF_W : 0);
     ph.p_flags = ph.p_flags | PF_R;
-    ph.p_offset = i * TOLD_PAGE_SIZE;
+    ph.p_offset = sg.file_offset;
     ph.p_vaddr = sg.start_addr;
     ph.p_paddr = sg.start_addr;
-    ph.p_filesz = sg.size;
-    ph.p_memsz = sg.size;
-    ph.p_align = TOLD_PAGE_SIZE;
+    ph.p_filesz = file_end - sg.file_offset;
+    ph.p_memsz = last.start_addr + last.size - sg.start_addr;
+    ph.p_align = page_size(e, sg);
+    phs.emplace_back(ph);
+  }
+  if (size_t note_size = build_id_note_size(e); note_size != 0) {
+    const size_t offset = build_id_note_offset(e);
+    elf::ElfProgramHeader ph{};
+    ph.p_type = PT_NOTE;
+    ph.p_flags = PF_R;
+    ph.p_offset = offset;
+    ph.p_vaddr = e.segment(elf::SectionType::Header).start_addr + offset;
+    ph.p_paddr = ph.p_vaddr;
+    ph.p_filesz = note_size;
+    ph.p_memsz = note_size;
+    ph.p_align = alignof(elf::Elf64_Word);
     phs.emplace_back(ph);
-    ++i;
   }
   return phs;
 }
@@ -286,11 +1252,22 @@ StringTable setup_section_header_str_table(Executable &e) {
   elf::ElfSectionHeader sh{};
   sh.sh_type = SHT_STRTAB;
   sh.sh_addralign = 1;
-  std::vector<char> table_data = {'\0', '.', 't', 'e', 'x', 't', '\0', '.', 's',
-                                  'h',  's', 't', 'r', 't', 'a', 'b',  '\0'};
+  // same order as create_section_headers hands out the names.
+  std::vector<char> table_data = {'\0'};
+  auto add_name = [&](std::string_view name) {
+    table_data.insert(table_data.end(), name.begin(), name.end());
+    table_data.push_back('\0');
+  };
+  if (build_id_note_size(e) != 0)
+    add_name(BUILD_ID_SECTION_NAME);
+  for (size_t i = 0; i < ACCEPTED_SECTIONS.size(); ++i) {
+    if (output_segment(e, ACCEPTED_SECTIONS[i]) != nullptr)
+      add_name(OUTPUT_SECTION_NAMES[i]);
+  }
+  sh.sh_name = static_cast<elf::Elf64_Word>(table_data.size());
+  add_name(".shstrtab");
 
   sh.sh_size = table_data.size();
-  sh.sh_name = static_cast<elf::Elf64_Word>(table_data.size() - 10);
   size_t sh_offset = compute_section_header_offset(e);
   sh_offset += e.section_headers.size() * sizeof(elf::ElfSectionHeader);
   sh.sh_offset = static_cast<elf::Elf64_Off>(sh_offset + padding_sz(sh_offset));
@@ -302,23 +1279,37 @@ StringTable setup_section_header_str_table(Executable &e) {
 
 std::vector<elf::ElfSectionHeader> create_section_headers(const Executable &e) {
   std::vector<elf::ElfSectionHeader> shs{elf::ElfSectionHeader{}};
-  shs.reserve(e.segments.size());
+  shs.reserve(elf::SECTION_TYPE_COUNT);
 
   // TODO(0): I kind of hate how the sect header string table is getting setup..
   //       this is something that really needs a good refactor.
-  size_t shstrtab_offset = 1; // this should be getting incremented by the size
-                              // of the section name..
+  size_t shstrtab_offset = 1;
+  if (size_t note_size = build_id_note_size(e); note_size != 0) {
+    const size_t offset = build_id_note_offset(e);
+    elf::ElfSectionHeader sh{};
+    sh.sh_name = static_cast<elf::Elf64_Word>(shstrtab_offset);
+    shstrtab_offset += BUILD_ID_SECTION_NAME.size() + 1;
+    sh.sh_type = SHT_NOTE;
+    sh.sh_flags = SHF_ALLOC;
+    sh.sh_addr = e.segment(elf::SectionType::Header).start_addr + offset;
+    sh.sh_offset = offset;
+    sh.sh_size = note_size;
+    sh.sh_addralign = alignof(elf::Elf64_Word);
+    shs.emplace_back(sh);
+  }
   for (size_t i = 0; i < ACCEPTED_SECTIONS.size(); ++i) {
-    const Segment &sg = e.segments.at(ACCEPTED_SECTIONS[i]);
+    const Segment *sg = output_segment(e, ACCEPTED_SECTIONS[i]);
+    if (sg == nullptr)
+      continue;
     elf::ElfSectionHeader sh{};
     sh.sh_name = static_cast<elf::Elf64_Word>(shstrtab_offset);
-    sh.sh_type = sg.loadable && sg.executable ? SHT_PROGBITS : SHT_NULL;
-    // TODO: SHF_ALLOC is not the correct default.
-    sh.sh_flags =
-        sg.loadable && sg.executable ? SHF_ALLOC | SHF_EXECINSTR : SHF_ALLOC;
-    sh.sh_addr = sg.start_addr;
-    sh.sh_offset = TOLD_PAGE_SIZE * (i + 1);
-    sh.sh_size = sg.size;
+    shstrtab_offset += OUTPUT_SECTION_NAMES[i].size() + 1;
+    sh.sh_type = ACCEPTED_SECTIONS[i] == elf::SectionType::Bss ? SHT_NOBITS
+                                                               : SHT_PROGBITS;
+    sh.sh_flags = ACCEPTED_FLAGS[i];
+    sh.sh_addr = sg->start_addr;
+    sh.sh_offset = sg->file_offset;
+    sh.sh_size = sg->size;
     sh.sh_link = 0;
     sh.sh_info = 0;
     // TODO: 1?
@@ -330,83 +1321,243 @@ std::vector<elf::ElfSectionHeader> create_section_headers(const Executable &e) {
   return shs;
 }
 
-void write_to_fs(const Executable &exec) {
-  std::ofstream output_exec(exec.path, std::ios_base::out | std::ios::binary);
-  size_t w_ptr{};
-  if (!output_exec.is_open()) {
-    std::cerr << "Output exec file is not open before writing\n";
+// Output file mapped writable. The file is sized up front, so everything not
+// explicitly written (all the padding between segments) reads back as zeros.
+struct OutputFile {
+  int fd;
+  char *data;
+  size_t size;
+};
+
+OutputFile open_output_file(const std::string &path, size_t size) {
+  // unlink first so that we don't scribble over (or fail with ETXTBSY on) a
+  // previous output that is still being executed.
+  unlink(path.c_str());
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    std::cerr << "Output exec file could not be opened for writing: "
+              << std::strerror(errno) << "\n";
     exit(1);
   }
-
-  output_exec.write(reinterpret_cast<const char *>(&exec.elf_header),
-                    sizeof(elf::ElfHeader));
-  w_ptr += sizeof(elf::ElfHeader);
-  for (const auto &ph : exec.program_headers) {
-    output_exec.write(reinterpret_cast<const char *>(&ph),
-                      sizeof(elf::ElfProgramHeader));
-    w_ptr += sizeof(elf::ElfProgramHeader);
+  if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+    std::cerr << "Output exec file could not be sized: "
+              << std::strerror(errno) << "\n";
+    unlink(path.c_str());
+    exit(1);
+  }
+  void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    std::cerr << "Output exec file could not be mapped: "
+              << std::strerror(errno) << "\n";
+    unlink(path.c_str());
+    exit(1);
   }
+  return OutputFile{fd, static_cast<char *>(data), size};
+}
 
-  // TODO: write out symbol table
+void close_output_file(OutputFile &out) {
+  munmap(out.data, out.size);
+  close(out.fd);
+}
 
-  std::optional<std::vector<char>> pad = padding(w_ptr);
-  if (pad.has_value())
-    output_exec.write(pad.value().data(), pad.value().size());
-  for (const auto &t : ACCEPTED_SECTIONS) {
-    w_ptr = 0;
-    elf::Block s_block = exec.segments.at(t).block;
-    w_ptr += s_block.size();
-    output_exec.write(reinterpret_cast<char *>(s_block.data()), s_block.size());
+size_t output_file_size(const Executable &exec) {
+  const elf::ElfSectionHeader &shstrtab = exec.section_headers.back();
+  return shstrtab.sh_offset + shstrtab.sh_size + padding_sz(shstrtab.sh_size);
+}
+
+// Hashes `image` a chunk per task, then hashes the chunks' digests in order,
+// so the id doesn't depend on how many threads there were.
+std::vector<uint8_t> build_id(BuildId kind, std::span<const char> image) {
+  TimeTraceScope trace{"build_id"};
+  AllocPhase phase{"build_id"};
+  const size_t chunks =
+      (image.size() + BUILD_ID_CHUNK_SIZE - 1) / BUILD_ID_CHUNK_SIZE;
+  const size_t digest_size = build_id_size(kind);
+  std::vector<char> digests(chunks * digest_size);
+  parallel_for(chunks, [&](size_t i) {
+    std::span<const char> chunk = image.subspan(
+        i * BUILD_ID_CHUNK_SIZE,
+        std::min(BUILD_ID_CHUNK_SIZE, image.size() - i * BUILD_ID_CHUNK_SIZE));
+    char *digest = digests.data() + i * digest_size;
+    if (kind == BuildId::Sha1) {
+      Sha1::Digest d = sha1(chunk);
+      std::memcpy(digest, d.data(), d.size());
+    } else {
+      uint64_t h = xxhash64(chunk);
+      std::memcpy(digest, &h, sizeof(h));
+    }
+  });
+
+  std::vector<uint8_t> id(digest_size);
+  if (kind == BuildId::Sha1) {
+    Sha1::Digest d = sha1(digests);
+    std::memcpy(id.data(), d.data(), d.size());
+  } else {
+    uint64_t h = xxhash64(digests);
+    std::memcpy(id.data(), &h, sizeof(h));
+  }
+  return id;
+}
+
+// Fills in .note.gnu.build-id once everything else is in `out`. The id is
+// computed with its own bytes still zero.
+void write_build_id(const Executable &exec, OutputFile &out) {
+  const size_t note_size = build_id_note_size(exec);
+  if (note_size == 0)
+    return;
+  char *note = out.data + build_id_note_offset(exec);
+  const size_t desc_size = build_id_size(exec.options.build_id);
+  const elf::Elf64_Word header[3] = {
+      static_cast<elf::Elf64_Word>(BUILD_ID_NOTE_NAME.size()),
+      static_cast<elf::Elf64_Word>(desc_size), NT_GNU_BUILD_ID};
+  std::memcpy(note, header, sizeof(header));
+  std::memcpy(note + sizeof(header), BUILD_ID_NOTE_NAME.data(),
+              BUILD_ID_NOTE_NAME.size());
+  std::vector<uint8_t> id =
+      build_id(exec.options.build_id, {out.data, out.size});
+  std::memcpy(note + note_size - desc_size, id.data(), id.size());
+}
 
-    pad = padding(w_ptr);
-    if (pad.has_value())
-      output_exec.write(pad.value().data(), pad.value().size());
+// Fills in the GOT: every slot holds the address of the symbol it is for.
+// Only run once relocating succeeded, so every one of them has an address.
+void write_got(const Executable &e, char *out) {
+  if (e.got.empty())
+    return;
+  char *got_out = out + e.segment(elf::SectionType::Got).file_offset;
+  for (size_t g = 0; g < e.got.size(); ++g) {
+    const SymbolRef ref = e.got[g];
+    std::optional<elf::Elf64_Addr> addr = reloc_symbol_addr(
+        e, e.modules[ref.module], e.section_offsets[ref.module],
+        e.symbol_ids[ref.module], ref.sym_index);
+    write_le<elf::Elf64_Addr>(got_out + g * sizeof(elf::Elf64_Addr),
+                              addr.value_or(0));
   }
+}
+
+void write_to_fs(const Executable &exec) {
+  OutputFile out = open_output_file(exec.path, output_file_size(exec));
+  // for --stats: whatever isn't written below is padding.
+  std::atomic<uint64_t> section_bytes{0};
+
+  std::memcpy(out.data, &exec.elf_header, sizeof(elf::ElfHeader));
+  std::memcpy(out.data + exec.elf_header.e_phoff, exec.program_headers.data(),
+              exec.program_headers.size() * sizeof(elf::ElfProgramHeader));
 
-  w_ptr = 0;
-  for (const auto &sh : exec.section_headers) {
-    output_exec.write(reinterpret_cast<const char *>(&sh),
-                      sizeof(elf::ElfSectionHeader));
-    w_ptr += sizeof(elf::ElfSectionHeader);
+  // TODO: write out symbol table
+
+  // every module copies its input sections to their final place in the file
+  // and then relocates them right there, in parallel with the others.
+  LinkErrors errors{};
+  parallel_for(exec.modules.size(), [&](size_t i) {
+    const elf::ElfBinary &mod = exec.modules[i];
+    TimeTraceScope trace{"emit_module", mod.given_path};
+    const std::vector<size_t> &offsets = exec.section_offsets[i];
+    uint64_t copied{};
+    for (size_t s = 0; s < mod.input_sections.size(); ++s) {
+      const elf::InputSection &sec = mod.input_sections[s];
+      // .bss is left to the loader to zero.
+      if (!exec.kept(i, s) || sec.type == elf::SectionType::Bss)
+        continue;
+      std::memcpy(out.data + exec.segment(sec.type).file_offset + offsets[s],
+                  sec.data.data(), sec.data.size());
+      copied += sec.data.size();
+    }
+    section_bytes.fetch_add(copied, std::memory_order_relaxed);
+    relocate_module(exec, i, out.data, errors);
+  });
+  // a half relocated output would still look like a finished one.
+  if (!errors.messages.empty()) {
+    close_output_file(out);
+    unlink(exec.path.c_str());
   }
-  pad = padding(w_ptr);
-  if (pad.has_value())
-    output_exec.write(pad.value().data(), pad.value().size());
-  w_ptr = exec.section_header_str_table.size();
-  for (size_t i = 0; i < exec.section_header_str_table.strings.size(); ++i) {
-    output_exec.write(reinterpret_cast<const char *>(
-                          &exec.section_header_str_table.strings[i]),
-                      1);
+  errors.exit_if_any();
+  write_got(exec, out.data);
+
+  std::memcpy(out.data + exec.elf_header.e_shoff, exec.section_headers.data(),
+              exec.section_headers.size() * sizeof(elf::ElfSectionHeader));
+  std::memcpy(out.data + exec.section_headers.back().sh_offset,
+              exec.section_header_str_table.strings.data(),
+              exec.section_header_str_table.size());
+  // last, it covers everything else.
+  write_build_id(exec, out);
+
+  if (stats_enabled()) {
+    const uint64_t written =
+        section_bytes.load() + sizeof(elf::ElfHeader) +
+        exec.program_headers.size() * sizeof(elf::ElfProgramHeader) +
+        exec.got.size() * sizeof(elf::Elf64_Addr) +
+        exec.section_headers.size() * sizeof(elf::ElfSectionHeader) +
+        exec.section_header_str_table.size() + build_id_note_size(exec);
+    add_stat(Stat::SectionBytesCopied, section_bytes.load());
+    add_stat(Stat::PaddingBytes, out.size - written);
+    add_stat(Stat::OutputBytes, out.size);
   }
-  pad = padding(w_ptr);
-  if (pad.has_value())
-    output_exec.write(pad.value().data(), pad.value().size());
+
+  close_output_file(out);
 }
 
 void write_out(const Executable &e) {
+  TimeTraceScope trace{"write_out"};
+  AllocPhase phase{"write_out"};
   if (TRULY_WRITE_EXEC_FILE) {
     write_to_fs(e);
   }
 }
 
+void chmod_executable(const Executable &e) {
+  fs::path binary{e.path};
+  if (fs::exists(binary)) {
+    std::cout << "told: -- chmod-ing " << binary << "..." << std::endl;
+    fs::permissions(binary, fs::perms::all ^ fs::perms::others_write);
+    std::cout << "told: -- Done!" << std::endl;
+  }
+}
+
 void apply_headers(Executable &e) {
+  TimeTraceScope trace{"apply_headers"};
+  AllocPhase phase{"apply_headers"};
   e.program_headers = std::move(create_program_headers(e));
   e.section_headers = std::move(create_section_headers(e));
   e.section_header_str_table = std::move(setup_section_header_str_table(e));
   add_elf_header(e);
 }
 
-Executable link(std::vector<std::string> &&module_order,
-                std::unordered_map<std::string, elf::ElfBinary> &&modules) {
-  Executable exec =
-      init_exec("a.told", std::move(module_order), std::move(modules));
+// Everything after symbol resolution.
+void lay_out(Executable &exec) {
+  if (exec.options.gc_sections)
+    gc_sections(exec);
+  if (exec.options.icf)
+    fold_identical_code(exec);
   compute_output_offsets(exec);
-  resolve_symbols(exec);
   merge_sections(exec);
+  create_got(exec);
   apply_addrs_and_adjustments_to_segments(exec);
   apply_addrs_to_symbols(exec);
-  apply_relocations(exec);
   apply_headers(exec);
+}
+
+Executable link(std::vector<elf::ElfBinary> &&modules,
+                std::vector<elf::Archive> &&archives, std::string output_path,
+                const LinkOptions &options) {
+  TimeTraceScope trace{"link"};
+  AllocPhase phase{"link"};
+  Executable exec = init_exec(std::move(output_path), std::move(modules),
+                              std::move(archives), options);
+  resolve_symbols(exec);
+  lay_out(exec);
+  return exec;
+}
+
+Executable link(const std::vector<std::string> &object_paths,
+                std::vector<elf::Archive> &&archives, std::string output_path,
+                const LinkOptions &options) {
+  TimeTraceScope trace{"link"};
+  AllocPhase phase{"link"};
+  Executable exec =
+      init_exec(std::move(output_path), {}, std::move(archives), options);
+  add_objects(exec, object_paths);
+  resolve_symbols(exec);
+  lay_out(exec);
   return exec;
 }
 
@@ -2,40 +2,106 @@
 
 #include <cstdint>
 #include <iostream>
+#include <optional>
 #include <string>
-#include <unordered_map>
+#include <string_view>
+#include <utility>
 #include <vector>
 
+#include "archive.h"
 #include "elf_utils.h"
+#include "symbol_table.h"
 
 // Default linker script specifies this as the executable start.
 // Reminder: you can look at the default script by running ld --verbose
 #define TOLD_START_ADDR (0x400000)
 // Standard page size is 4KB on x86-64
 #define TOLD_PAGE_SIZE (0x1000)
+// and a huge page (a PMD mapping, which THP uses) is 2MB.
+#define TOLD_HUGE_PAGE_SIZE (0x200000)
 
 inline const std::string ENTRY_SYM = "_start";
+// Assemblers reference it as soon as a GOT relocation is used, the linker
+// defines it at the start of the GOT.
+inline const std::string GOT_SYM = "_GLOBAL_OFFSET_TABLE_";
+inline const std::string DEFAULT_OUTPUT_PATH = "a.told";
 
 namespace told {
 
+// An output segment. Its contents are never materialized in memory: the
+// sections that make it up are copied from the input mappings straight into
+// the output file by write_out. Consecutive segments with the same
+// permissions share one PT_LOAD, the way .data and .bss do.
 struct Segment {
-  elf::Block block;
   size_t start_addr;
-  size_t size;
+  size_t size; // in memory, .bss takes up no room in the file
   size_t relative_offset;
   bool readable;
   bool loadable;
   bool executable;
   bool writable;
+  size_t file_offset;
+  size_t align; // largest alignment of the input sections in it
 };
 
-struct GlobalSymTableEntry {
-  std::string def_module;
-  elf::Elf64_Addr value;
-  elf::Elf64_Addr addr;
-  elf::SectionType type;
+// Output offset of an input section that isn't part of the output.
+inline constexpr size_t NOT_PLACED = SIZE_MAX;
+
+// What --build-id puts in .note.gnu.build-id.
+enum class BuildId : uint8_t {
+  None,
+  Fast, // xxHash64, 8 bytes
+  Sha1, // 20 bytes
+};
+
+struct LinkOptions {
+  // leave out input sections that nothing reachable from ENTRY_SYM refers to.
+  bool gc_sections = false;
+  // fold executable sections with identical contents and relocations into one.
+  bool icf = false;
+  // file listing the symbols whose sections are placed first, in that order.
+  std::string symbol_ordering_file{};
+  BuildId build_id = BuildId::None;
+  // start executable segments on a huge page boundary, in the file and in
+  // memory, and keep every other segment off their huge pages, so that their
+  // text can be backed by huge pages.
+  bool hugepage_text = false;
+
+  // Whether every input section is laid out in input order, which is the only
+  // layout --incremental knows how to patch.
+  bool default_layout() const {
+    return !gc_sections && !icf && symbol_ordering_file.empty();
+  }
+};
+
+// What becomes of an input section in the output.
+enum class SectionFate : uint8_t {
+  Kept,    // laid out and written
+  Dropped, // unreachable, left out by --gc-sections
+  Folded,  // identical to another section (--icf) and shares its address
+};
+
+// Input section `section` of Executable::modules[module].
+struct SectionRef {
+  uint32_t module;
+  uint32_t section;
+};
+
+// Symbol `sym_index` of Executable::modules[module].
+struct SymbolRef {
+  uint32_t module;
+  uint32_t sym_index;
 };
 
+// GOT slot of a symbol that no GOT relocation against it needs.
+inline constexpr uint32_t NO_GOT_SLOT = UINT32_MAX;
+
+// Applies `arg` to `options` if it is a link option (e.g. --gc-sections).
+// Returns false if it isn't one.
+bool parse_link_option(std::string_view arg, LinkOptions &options);
+// The arguments parse_link_option turns back into `options`.
+std::vector<std::string> link_option_args(const LinkOptions &options);
+
 struct StringTable {
   elf::SectionType type;
   std::vector<char> strings;
@@ -45,27 +111,123 @@ struct StringTable {
   }
 };
 
+// Everything about the link is kept in flat arrays. Modules are numbered by
+// their position in `modules` and every per-module table below is indexed by
+// that number, per-segment data is indexed by SectionType.
 struct Executable {
   std::string path;
-  // contains names of input modules.
-  // TODO: these really should be canonicalized paths.
-  std::vector<std::string> module_order;
-  std::unordered_map<std::string, elf::ElfBinary> input_modules;
-  // maps modules to their offset in the output text segment
-  std::unordered_map<std::string, size_t> text_segment_offsets;
-  std::unordered_map<elf::SectionType, Segment> segments;
-  std::unordered_map<elf::Symbol, GlobalSymTableEntry> g_symbol_table;
+  // the object files given on the command line, in order, followed by the
+  // archive members pulled in during resolution. A module is named by its
+  // given_path.
+  std::vector<elf::ElfBinary> modules;
+  // archives members are extracted from on demand, searched in order.
+  std::vector<elf::Archive> archives;
+  LinkOptions options;
+  // the offset of each of a module's input sections in its output segment,
+  // indexed like ElfBinary::input_sections. NOT_PLACED for sections left out.
+  std::vector<std::vector<size_t>> section_offsets;
+  // set by gc_sections and fold_identical_code, indexed the same way. Every
+  // section of a module without an entry (or with an empty one) is kept.
+  std::vector<std::vector<SectionFate>> section_fates;
+  // every folded section and the kept section it was folded into.
+  std::vector<std::pair<SectionRef, SectionRef>> folded_sections;
+  elf::BySectionType<std::optional<Segment>> segments;
+  SymbolTable g_symbol_table;
+  // the g_symbol_table id of each of a module's symbols, indexed like
+  // ElfBinary::symtab_entries. NO_SYMBOL for locals. Relocations go through
+  // these rather than looking names up again.
+  std::vector<std::vector<SymbolId>> symbol_ids;
+  // what each GOT slot holds the address of, named by its first reference.
+  std::vector<SymbolRef> got;
+  // the GOT slot of each of a module's symbols, indexed like
+  // ElfBinary::symtab_entries; NO_GOT_SLOT if it has none. Empty for modules
+  // whose GOT relocations were all relaxed.
+  std::vector<std::vector<uint32_t>> got_slots;
   std::vector<elf::ElfSectionHeader> section_headers;
   std::vector<elf::ElfProgramHeader> program_headers;
   elf::ElfHeader elf_header;
   StringTable section_header_str_table;
+
+  const std::string &module_name(size_t module) const {
+    return modules[module].given_path;
+  }
+
+  Segment &segment(elf::SectionType t) { return segments[t].value(); }
+  const Segment &segment(elf::SectionType t) const {
+    return segments[t].value();
+  }
+
+  // Whether input section `section` of `module` is written to the output.
+  bool kept(size_t module, size_t section) const {
+    return module >= section_fates.size() || section_fates[module].empty() ||
+           section_fates[module][section] == SectionFate::Kept;
+  }
 };
 
 elf::ElfBinary parse_object(const std::string &file_path);
 
-Executable link(std::vector<std::string> &&module_order,
-                std::unordered_map<std::string, elf::ElfBinary> &&modules);
+// Parses every path on up to thread_count() threads. The result is in the same
+// order as `file_paths`. If any input fails to parse, the error for the first
+// failing path (in input order) is rethrown once all workers are done.
+std::vector<elf::ElfBinary>
+parse_objects(const std::vector<std::string> &file_paths);
+
+// Links `modules`, in that order.
+Executable link(std::vector<elf::ElfBinary> &&modules,
+                std::vector<elf::Archive> &&archives,
+                std::string output_path = DEFAULT_OUTPUT_PATH,
+                const LinkOptions &options = {});
+// Links the object files at `object_paths`, in that order, resolving their
+// symbols while they're being parsed (see add_objects). Parse errors are
+// thrown as parse_objects does.
+Executable link(const std::vector<std::string> &object_paths,
+                std::vector<elf::Archive> &&archives,
+                std::string output_path = DEFAULT_OUTPUT_PATH,
+                const LinkOptions &options = {});
 
+// The phases link() runs, in order. Exposed so that told_bench can time each
+// of them on its own.
+Executable init_exec(std::string &&output_path,
+                     std::vector<elf::ElfBinary> &&modules,
+                     std::vector<elf::Archive> &&archives = {},
+                     const LinkOptions &options = {});
+// Parses the object files at `file_paths` and appends them to e.modules in
+// that order. Every module's symbols go into the global symbol table as soon
+// as it has been parsed, while later inputs are still being read, which
+// leaves resolve_symbols little more than the archives to do. If any input
+// fails to parse, the error for the first failing path (in input order) is
+// rethrown once all workers are done.
+void add_objects(Executable &e, const std::vector<std::string> &file_paths);
+// Also extracts whichever archive members are needed, so it has to run before
+// anything that walks the modules.
+void resolve_symbols(Executable &e);
+// Marks the input sections reachable from ENTRY_SYM through relocations, the
+// rest are left out of the output. Only run with --gc-sections.
+void gc_sections(Executable &e);
+// Folds kept executable sections that are identical, down to what their
+// relocations refer to, into the first of them. Only run with --icf.
+void fold_identical_code(Executable &e);
+void compute_output_offsets(Executable &e);
+void merge_sections(Executable &e);
+// Gives a GOT slot to every symbol some GOT relocation refers to through an
+// instruction that can't be relaxed to a direct reference.
+void create_got(Executable &e);
+void apply_addrs_and_adjustments_to_segments(Executable &e);
+void apply_addrs_to_symbols(Executable &e);
+void apply_headers(Executable &e);
+
+// Applies every module's relocations to `out`, an image of the output file
+// with each input section already at its place.
+void apply_relocations(const Executable &e, char *out);
+// Like apply_relocations, but returns false on the first kind of error
+// instead of reporting it and exiting. `out` may be partly relocated then.
+bool try_apply_relocations(const Executable &e, char *out);
+
+// Creates the output file, copies each module's sections straight from its
+// input mapping to their final offsets and relocates them in place there.
 void write_out(const Executable &exec);
 
+// Makes the written output executable.
+void chmod_executable(const Executable &e);
+
 } // namespace told
@@ -0,0 +1,70 @@
+#!/bin/sh
+# Links data/minimal_reloc through a told server running with several
+# threads, a few times over. The server forks a child for every link after
+# its own thread pool is up, the child has to link with a pool of its own.
+# Last, an input listed twice has to fail the way it does without a server.
+#
+#   server_threads.sh TOLD CC DATA_DIR
+set -eu
+
+told=$1
+cc=$2
+data=$3
+
+work=$(mktemp -d)
+server=
+cleanup() {
+  if [ -n "$server" ]; then
+    kill "$server" 2>/dev/null || true
+  fi
+  rm -rf "$work"
+}
+trap cleanup EXIT
+cd "$work"
+
+"$cc" -c -O0 -fno-asynchronous-unwind-tables "$data/exit.c" "$data/start.c"
+
+"$told" --threads=4 --server="$work/s.sock" >server.log 2>&1 &
+server=$!
+tries=0
+while [ ! -S "$work/s.sock" ]; do
+  tries=$((tries + 1))
+  if [ "$tries" -gt 100 ]; then
+    echo "server did not come up" >&2
+    cat server.log >&2
+    exit 1
+  fi
+  sleep 0.1
+done
+
+for run in 1 2 3; do
+  # the first run has the server parse with its pool, the second links from
+  # the cache, the third parses again.
+  if [ "$run" = 3 ]; then
+    touch exit.o
+  fi
+  rm -f a.told
+  if ! timeout 30 "$told" --threads=4 --connect="$work/s.sock" exit.o \
+      start.o >/dev/null; then
+    echo "link $run through the server failed" >&2
+    exit 1
+  fi
+  status=0
+  ./a.told || status=$?
+  if [ "$status" != 119 ]; then
+    echo "link $run: a.told exited with $status, want 119" >&2
+    exit 1
+  fi
+done
+
+# both copies come from the same cache entry.
+status=0
+timeout 30 "$told" --threads=4 --connect="$work/s.sock" exit.o exit.o \
+    start.o >dup.log 2>&1 || status=$?
+if [ "$status" != 1 ] ||
+    ! grep -q "multiple definitions for symbol exit119" dup.log; then
+  echo "linking exit.o twice exited with $status, want 1 and:" >&2
+  echo "  multiple definitions for symbol exit119" >&2
+  cat dup.log >&2
+  exit 1
+fi